@@ -0,0 +1,287 @@
+// Released under MIT License.
+// Copyright (c) 2023 Ladislav Bartos
+
+// Compares the optimized code paths of leaflets2ndx with the original implementations they replaced:
+//   split_residues   residue spans vs. groan's selection_splitbyres
+//   write            buffered ndx writer vs. per-atom fprintf
+//   center           vectorized center kernel vs. groan's center_of_geometry
+// Reports the best wall time out of several repetitions and the number of memory allocations of a single run.
+//
+// Built together with main.c (see makefile), linked with --wrap=malloc,--wrap=calloc,--wrap=realloc to count allocations.
+
+#define main leaflets2ndx_main
+#include "../main.c"
+#undef main
+
+#define REPETITIONS 3
+
+/*
+ * Counting wrappers of the memory allocation functions.
+ */
+// volatile, since the compiler assumes that malloc does not modify any of our variables
+static volatile size_t n_allocations = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *pointer, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    ++n_allocations;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size)
+{
+    ++n_allocations;
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *pointer, size_t size)
+{
+    ++n_allocations;
+    return __real_realloc(pointer, size);
+}
+
+/*
+ * Writes ndx group the way leaflets2ndx originally did: one fprintf call per atom.
+ */
+static void baseline_write_ndx_group(FILE *stream, const char *name, const atom_selection_t *selection)
+{
+    fprintf(stream, "[ %s ]\n", name);
+    for (size_t i = 0; i < selection->n_atoms; ++i) {
+        fprintf(stream, "%4ld ", (long) selection->atoms[i]->gmx_atom_number);
+
+        if ((i + 1) % 15 == 0 || i + 1 == selection->n_atoms) fprintf(stream, "\n");
+    }
+}
+
+/*
+ * Reads the whole file into memory. Returns pointer to the data or NULL if the file could not be read.
+ */
+static char *read_file(const char *path, size_t *size)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) return NULL;
+
+    fseek(file, 0, SEEK_END);
+    *size = (size_t) ftell(file);
+    rewind(file);
+
+    char *data = malloc(*size + 1);
+    if (data != NULL && fread(data, 1, *size, file) != *size) {
+        free(data);
+        data = NULL;
+    }
+
+    fclose(file);
+    return data;
+}
+
+static void print_row(const char *benchmark, const char *path, const double seconds, const size_t allocations, const size_t n_atoms)
+{
+    printf("%-16s %-10s %12.6f %12.2f %14zu\n", benchmark, path, seconds, seconds * 1e9 / n_atoms, allocations);
+}
+
+/*
+ * Splits the membrane into residues using both implementations.
+ */
+static int compare_split(const atom_selection_t *membrane)
+{
+    double best[2] = { 1e30, 1e30 };
+    size_t allocations[2] = { 0 };
+
+    for (int r = 0; r < REPETITIONS; ++r) {
+        size_t allocations_start = n_allocations;
+        double start = monotonic_seconds();
+        atom_selection_t **residues = NULL;
+        size_t n_residues = selection_splitbyres(membrane, &residues);
+        // the residues are used, so that the compiler can not remove the splitting
+        size_t baseline_atoms = 0;
+        for (size_t i = 0; i < n_residues; ++i) baseline_atoms += residues[i]->n_atoms;
+        destroy_selections(residues, n_residues);
+        double time = monotonic_seconds() - start;
+        if (time < best[0]) best[0] = time;
+        allocations[0] = n_allocations - allocations_start;
+
+        allocations_start = n_allocations;
+        start = monotonic_seconds();
+        residue_span_t *spans = NULL;
+        size_t n_spans = split_residues(membrane, &spans);
+        size_t current_atoms = 0;
+        for (size_t i = 0; i < n_spans; ++i) current_atoms += spans[i].length;
+        free(spans);
+        time = monotonic_seconds() - start;
+        if (time < best[1]) best[1] = time;
+        allocations[1] = n_allocations - allocations_start;
+
+        if (n_spans != n_residues || baseline_atoms != membrane->n_atoms || current_atoms != membrane->n_atoms) {
+            fprintf(stderr, "Residues differ: %zu (baseline) vs. %zu (current).\n", n_residues, n_spans);
+            return 1;
+        }
+    }
+
+    print_row("split_residues", "baseline", best[0], allocations[0], membrane->n_atoms);
+    print_row("split_residues", "current", best[1], allocations[1], membrane->n_atoms);
+    return 0;
+}
+
+/*
+ * Writes the membrane as a single ndx group using both implementations and checks that the outputs are identical.
+ */
+static int compare_write(atom_selection_t *membrane, const char *prefix)
+{
+    char baseline_path[PATH_MAX] = "";
+    char current_path[PATH_MAX] = "";
+    snprintf(baseline_path, sizeof(baseline_path), "%s.compare_baseline.ndx", prefix);
+    snprintf(current_path, sizeof(current_path), "%s.compare_current.ndx", prefix);
+
+    double best[2] = { 1e30, 1e30 };
+    size_t allocations[2] = { 0 };
+
+    for (int r = 0; r < REPETITIONS; ++r) {
+        size_t allocations_start = n_allocations;
+        double start = monotonic_seconds();
+        FILE *stream = fopen(baseline_path, "w");
+        if (stream == NULL) {
+            fprintf(stderr, "File %s could not be opened.\n", baseline_path);
+            return 1;
+        }
+        baseline_write_ndx_group(stream, "Membrane", membrane);
+        fclose(stream);
+        double time = monotonic_seconds() - start;
+        if (time < best[0]) best[0] = time;
+        allocations[0] = n_allocations - allocations_start;
+
+        allocations_start = n_allocations;
+        start = monotonic_seconds();
+        ndx_writer_t *writer = ndx_writer_open(current_path, 1);
+        if (writer == NULL) {
+            fprintf(stderr, "File %s could not be opened.\n", current_path);
+            unlink(baseline_path);
+            return 1;
+        }
+        write_ndx_group(writer, "Membrane", membrane);
+        int error = ndx_writer_destroy(writer);
+        time = monotonic_seconds() - start;
+        if (time < best[1]) best[1] = time;
+        allocations[1] = n_allocations - allocations_start;
+
+        if (error) {
+            fprintf(stderr, "Could not write %s.\n", current_path);
+            unlink(baseline_path);
+            return 1;
+        }
+    }
+
+    size_t baseline_size = 0, current_size = 0;
+    char *baseline = read_file(baseline_path, &baseline_size);
+    char *current = read_file(current_path, &current_size);
+    int identical = baseline != NULL && current != NULL && baseline_size == current_size && memcmp(baseline, current, baseline_size) == 0;
+    free(baseline);
+    free(current);
+    unlink(baseline_path);
+    unlink(current_path);
+
+    print_row("write", "baseline", best[0], allocations[0], membrane->n_atoms);
+    print_row("write", "current", best[1], allocations[1], membrane->n_atoms);
+    printf("write throughput: %.1f MB/s (baseline) vs. %.1f MB/s (current), output %s\n",
+            baseline_size / best[0] / 1e6, current_size / best[1] / 1e6, identical ? "identical" : "DIFFERS");
+
+    return !identical;
+}
+
+/*
+ * Calculates the membrane center using both implementations.
+ * The current kernel works on coordinates gathered into the frame; the gathering is timed separately.
+ */
+static int compare_center(atom_selection_t *membrane, const lipid_topology_t *topology, const system_t *system)
+{
+    frame_t *frame = frame_create(topology, 0);
+    if (frame == NULL) {
+        fprintf(stderr, "Could not allocate memory for the frame.\n");
+        return 1;
+    }
+
+    double best[3] = { 1e30, 1e30, 1e30 };
+    size_t allocations[3] = { 0 };
+    vec_t baseline_center = { 0.0f }, current_center = { 0.0f };
+
+    for (int r = 0; r < REPETITIONS; ++r) {
+        size_t allocations_start = n_allocations;
+        double start = monotonic_seconds();
+        int error = center_of_geometry(membrane, baseline_center, system->box);
+        double time = monotonic_seconds() - start;
+        if (time < best[0]) best[0] = time;
+        allocations[0] = n_allocations - allocations_start;
+
+        allocations_start = n_allocations;
+        start = monotonic_seconds();
+        frame_load(frame, topology, system, 0);
+        time = monotonic_seconds() - start;
+        if (time < best[2]) best[2] = time;
+        allocations[2] = n_allocations - allocations_start;
+
+        allocations_start = n_allocations;
+        start = monotonic_seconds();
+        error |= membrane_center(frame, topology->n_atoms, NULL, 1, current_center);
+        time = monotonic_seconds() - start;
+        if (time < best[1]) best[1] = time;
+        allocations[1] = n_allocations - allocations_start;
+
+        if (error) {
+            fprintf(stderr, "Could not calculate membrane center.\n");
+            frame_destroy(frame);
+            return 1;
+        }
+    }
+
+    print_row("center", "baseline", best[0], allocations[0], membrane->n_atoms);
+    print_row("center", "current", best[1], allocations[1], membrane->n_atoms);
+    // done once per frame by the reading thread, so it is reported separately
+    print_row("center", "gather", best[2], allocations[2], membrane->n_atoms);
+
+    float difference = 0.0f;
+    for (int dim = 0; dim < 3; ++dim) {
+        float d = fabsf(minimum_image(current_center[dim] - baseline_center[dim], system->box[dim]));
+        if (d > difference) difference = d;
+    }
+    printf("center difference: %.6f nm\n", difference);
+
+    frame_destroy(frame);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 5) {
+        printf("Usage: %s GRO_FILE NDX_FILE MEMBRANE_SELECTION HEAD_SELECTION\n", argv[0]);
+        return 1;
+    }
+
+    system_t *system = read_gro(argv[1], 1);
+    if (system == NULL) {
+        fprintf(stderr, "File %s could not be read.\n", argv[1]);
+        return 1;
+    }
+
+    timings_t timings = { 0 };
+    atom_selection_t *membrane = NULL;
+    list_t *residue_names = NULL;
+    lipid_topology_t *topology = select_topology(system, argv[2], 0, argv[3], argv[4], &membrane, &residue_names, &timings);
+    if (topology == NULL) {
+        free(system);
+        return 1;
+    }
+
+    printf("%-16s %-10s %12s %12s %14s\n", "benchmark", "path", "time [s]", "ns/atom", "allocations");
+    int return_code = compare_split(membrane) != 0 ||
+            compare_write(membrane, argv[1]) != 0 ||
+            compare_center(membrane, topology, system) != 0;
+
+    topology_destroy(topology);
+    list_destroy(residue_names);
+    free(membrane);
+    free(system);
+    return return_code;
+}
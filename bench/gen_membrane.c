@@ -0,0 +1,307 @@
+// Released under MIT License.
+// Copyright (c) 2023 Ladislav Bartos
+
+// Generator of synthetic lipid bilayers and vesicles for benchmarking leaflets2ndx.
+// Writes a gro file and an ndx file containing the group 'Membrane'.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define MAX_SPECIES 64
+
+/*
+ * Lipid species. The first atom in `names` is the lipid head. Atoms are placed from the head towards the membrane center.
+ */
+typedef struct species {
+    const char *resname;
+    int n_atoms;
+    const char *names[16];  // coarse-grained bead names
+    const char *head_aa;    // name of the head atom in all-atom representation
+    int n_atoms_aa;
+} species_t;
+
+static const species_t SPECIES[] = {
+    { "POPC", 12, { "PO4", "NC3", "GL1", "GL2", "C1A", "D2A", "C3A", "C4A", "C1B", "C2B", "C3B", "C4B" }, "P", 52 },
+    { "DOPC", 12, { "PO4", "NC3", "GL1", "GL2", "C1A", "D2A", "C3A", "C4A", "C1B", "D2B", "C3B", "C4B" }, "P", 54 },
+    { "POPE", 12, { "PO4", "NH3", "GL1", "GL2", "C1A", "D2A", "C3A", "C4A", "C1B", "C2B", "C3B", "C4B" }, "P", 49 },
+    { "DOPE", 12, { "PO4", "NH3", "GL1", "GL2", "C1A", "D2A", "C3A", "C4A", "C1B", "D2B", "C3B", "C4B" }, "P", 51 },
+    { "POPS", 12, { "PO4", "CNO", "GL1", "GL2", "C1A", "D2A", "C3A", "C4A", "C1B", "C2B", "C3B", "C4B" }, "P", 53 },
+    { "POPG", 12, { "PO4", "GL0", "GL1", "GL2", "C1A", "D2A", "C3A", "C4A", "C1B", "C2B", "C3B", "C4B" }, "P", 52 },
+    { "CHOL", 8, { "ROH", "R1", "R2", "R3", "R4", "R5", "C1", "C2" }, "O3", 28 },
+};
+
+#define N_SPECIES (sizeof(SPECIES) / sizeof(species_t))
+
+void print_usage(const char *program_name)
+{
+    printf("Usage: %s [OPTION]...\n", program_name);
+    printf("\nOPTIONS\n");
+    printf("-h               print this message and exit\n");
+    printf("-l INTEGER       number of lipids (default: 1000)\n");
+    printf("-m STRING        species mix as RESNAME:WEIGHT,... (default: POPC:1)\n");
+    printf("-a               use all-atom naming of lipid heads (default: coarse-grained)\n");
+    printf("-x FLOAT         box size in x and y [nm] (default: derived from area per lipid)\n");
+    printf("-z FLOAT         box size in z [nm] (default: 10.0)\n");
+    printf("-u FLOAT         amplitude of membrane undulation along x [nm] (default: 0.0)\n");
+    printf("-v               generate a spherical vesicle instead of a planar bilayer (ignores -x, -z and -u)\n");
+    printf("-s INTEGER       random seed (default: 1)\n");
+    printf("-o STRING        prefix of the output files (default: membrane)\n");
+    printf("\n");
+    printf("Available species:");
+    for (size_t i = 0; i < N_SPECIES; ++i) printf(" %s", SPECIES[i].resname);
+    printf("\n\n");
+}
+
+/*
+ * Parses the species mix. Returns the number of species in the mix or 0 if the mix is invalid.
+ */
+size_t parse_mix(const char *string, const species_t **species, double *weights)
+{
+    char *copy = strdup(string);
+    if (copy == NULL) return 0;
+
+    size_t n = 0;
+    for (char *token = strtok(copy, ","); token != NULL; token = strtok(NULL, ",")) {
+        if (n >= MAX_SPECIES) {
+            fprintf(stderr, "Too many species in the mix.\n");
+            free(copy);
+            return 0;
+        }
+
+        char *colon = strchr(token, ':');
+        weights[n] = 1.0;
+        if (colon != NULL) {
+            *colon = '\0';
+            weights[n] = atof(colon + 1);
+        }
+
+        species[n] = NULL;
+        for (size_t i = 0; i < N_SPECIES; ++i) {
+            if (strcmp(SPECIES[i].resname, token) == 0) species[n] = &SPECIES[i];
+        }
+
+        if (species[n] == NULL || weights[n] <= 0.0) {
+            fprintf(stderr, "Invalid species '%s' in the mix.\n", token);
+            free(copy);
+            return 0;
+        }
+        ++n;
+    }
+
+    free(copy);
+    return n;
+}
+
+/*
+ * Simple reproducible random number generator (xorshift64*). Returns a number in [0, 1).
+ */
+static double next_random(unsigned long long *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return (double) ((*state * 2685821657736338717ULL) >> 11) / 9007199254740992.0;
+}
+
+int main(int argc, char **argv)
+{
+    size_t n_lipids = 1000;
+    const char *mix = "POPC:1";
+    int all_atom = 0;
+    double box_xy = 0.0;
+    double box_z = 10.0;
+    double undulation = 0.0;
+    int vesicle = 0;
+    unsigned long long seed = 1;
+    const char *prefix = "membrane";
+
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "l:m:ax:z:u:vs:o:h")) != -1) {
+        switch (opt) {
+        case 'l':
+            n_lipids = strtoul(optarg, NULL, 10);
+            break;
+        case 'm':
+            mix = optarg;
+            break;
+        case 'a':
+            all_atom = 1;
+            break;
+        case 'x':
+            box_xy = atof(optarg);
+            break;
+        case 'z':
+            box_z = atof(optarg);
+            break;
+        case 'u':
+            undulation = atof(optarg);
+            break;
+        case 'v':
+            vesicle = 1;
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'o':
+            prefix = optarg;
+            break;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    const species_t *species[MAX_SPECIES] = { 0 };
+    double weights[MAX_SPECIES] = { 0.0 };
+    size_t n_species = parse_mix(mix, species, weights);
+    if (n_species == 0 || n_lipids < 2 || box_z <= 4.0 + 2.0 * fabs(undulation)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    double total_weight = 0.0;
+    for (size_t i = 0; i < n_species; ++i) total_weight += weights[i];
+
+    // lipids are placed on a jittered square grid in each leaflet
+    size_t n_leaflet = (n_lipids + 1) / 2;
+    size_t side = (size_t) ceil(sqrt((double) n_leaflet));
+    if (box_xy <= 0.0) box_xy = sqrt(n_leaflet * (all_atom ? 0.65 : 0.64));
+    double spacing = box_xy / side;
+
+    char gro_file[4096], ndx_file[4096];
+    snprintf(gro_file, sizeof(gro_file), "%s.gro", prefix);
+    snprintf(ndx_file, sizeof(ndx_file), "%s.ndx", prefix);
+
+    FILE *gro = fopen(gro_file, "w");
+    FILE *ndx = fopen(ndx_file, "w");
+    if (gro == NULL || ndx == NULL) {
+        fprintf(stderr, "Output files could not be opened.\n");
+        if (gro != NULL) fclose(gro);
+        if (ndx != NULL) fclose(ndx);
+        return 1;
+    }
+
+    // assign species first to know the total number of atoms
+    unsigned char *lipid_species = malloc(n_lipids);
+    if (lipid_species == NULL) {
+        fprintf(stderr, "Could not allocate memory.\n");
+        fclose(gro);
+        fclose(ndx);
+        return 1;
+    }
+
+    unsigned long long state = seed * 0x9E3779B97F4A7C15ULL + 1;
+    size_t n_atoms = 0;
+    for (size_t i = 0; i < n_lipids; ++i) {
+        double r = next_random(&state) * total_weight;
+        size_t s = 0;
+        while (s + 1 < n_species && r >= weights[s]) r -= weights[s++];
+        lipid_species[i] = (unsigned char) s;
+        n_atoms += all_atom ? species[s]->n_atoms_aa : species[s]->n_atoms;
+    }
+
+    fprintf(gro, "Synthetic %s of %zu lipids\n%5zu\n", vesicle ? "vesicle" : "bilayer", n_lipids, n_atoms);
+    fprintf(ndx, "[ Membrane ]\n");
+
+    size_t atom = 0;
+    if (vesicle) {
+        // heads of the outer and inner leaflet lie on spheres 4 nm apart; the lipids are split between
+        // the leaflets according to the areas of the spheres (R_out^2 + R_in^2 = N * area per lipid / 4 pi)
+        double k = n_lipids * (all_atom ? 0.65 : 0.64) / (4.0 * M_PI);
+        double radius_outer = (8.0 + sqrt(64.0 - 8.0 * (16.0 - k))) / 4.0;
+        double radius_inner = radius_outer - 4.0;
+        if (radius_inner < 2.0) {
+            fprintf(stderr, "Too few lipids to build a vesicle.\n");
+            free(lipid_species);
+            fclose(gro);
+            fclose(ndx);
+            return 1;
+        }
+
+        size_t n_outer = (size_t) (n_lipids * radius_outer * radius_outer / (radius_outer * radius_outer + radius_inner * radius_inner));
+        double box = 2.0 * radius_outer + 6.0;
+        double golden_angle = M_PI * (3.0 - sqrt(5.0));
+
+        for (size_t i = 0; i < n_lipids; ++i) {
+            const species_t *lipid = species[lipid_species[i]];
+            int outer = i < n_outer;
+            size_t n_sphere = outer ? n_outer : n_lipids - n_outer;
+            size_t k_sphere = outer ? i : i - n_outer;
+
+            // Fibonacci lattice on the sphere
+            double u_z = 1.0 - 2.0 * (k_sphere + 0.5) / n_sphere;
+            double u_r = sqrt(1.0 - u_z * u_z);
+            double phi = golden_angle * k_sphere;
+            double direction[3] = { u_r * cos(phi), u_r * sin(phi), u_z };
+            double head_radius = (outer ? radius_outer : radius_inner) + 0.4 * (next_random(&state) - 0.5);
+
+            int n = all_atom ? lipid->n_atoms_aa : lipid->n_atoms;
+            double step = 1.8 / n;
+            for (int j = 0; j < n; ++j) {
+                char name[16] = "";
+                if (j == 0) snprintf(name, sizeof(name), "%s", all_atom ? lipid->head_aa : lipid->names[0]);
+                else if (all_atom) snprintf(name, sizeof(name), "C%d", j);
+                else snprintf(name, sizeof(name), "%s", lipid->names[j]);
+
+                // tails point towards the middle of the membrane
+                double radius = head_radius + (outer ? -step : step) * j;
+                fprintf(gro, "%5zu%-5s%5s%5zu%8.3f%8.3f%8.3f\n",
+                        (i + 1) % 100000, lipid->resname, name, (atom + 1) % 100000,
+                        box / 2.0 + radius * direction[0], box / 2.0 + radius * direction[1], box / 2.0 + radius * direction[2]);
+
+                ++atom;
+                fprintf(ndx, "%4zu ", atom);
+                if (atom % 15 == 0 || atom == n_atoms) fprintf(ndx, "\n");
+            }
+        }
+
+        fprintf(gro, "%10.5f%10.5f%10.5f\n", box, box, box);
+
+        free(lipid_species);
+        fclose(gro);
+        fclose(ndx);
+        return 0;
+    }
+
+    double center = box_z / 2.0;
+    for (size_t i = 0; i < n_lipids; ++i) {
+        const species_t *lipid = species[lipid_species[i]];
+        int upper = i % 2;
+        size_t slot = i / 2;
+        double x = (slot % side + 0.5 + 0.3 * (next_random(&state) - 0.5)) * spacing;
+        double y = (slot / side + 0.5 + 0.3 * (next_random(&state) - 0.5)) * spacing;
+        // the whole bilayer follows a sine wave spanning the box once along x
+        double head_z = center + (upper ? 2.0 : -2.0) + 0.4 * (next_random(&state) - 0.5) + undulation * sin(2.0 * M_PI * x / box_xy);
+
+        int n = all_atom ? lipid->n_atoms_aa : lipid->n_atoms;
+        double step = 1.8 / n;
+        for (int j = 0; j < n; ++j) {
+            char name[16] = "";
+            if (j == 0) snprintf(name, sizeof(name), "%s", all_atom ? lipid->head_aa : lipid->names[0]);
+            else if (all_atom) snprintf(name, sizeof(name), "C%d", j);
+            else snprintf(name, sizeof(name), "%s", lipid->names[j]);
+
+            double atom_z = head_z + (upper ? -step : step) * j;
+            fprintf(gro, "%5zu%-5s%5s%5zu%8.3f%8.3f%8.3f\n",
+                    (i + 1) % 100000, lipid->resname, name, (atom + 1) % 100000, fmod(x, box_xy), fmod(y, box_xy), atom_z);
+
+            ++atom;
+            fprintf(ndx, "%4zu ", atom);
+            if (atom % 15 == 0 || atom == n_atoms) fprintf(ndx, "\n");
+        }
+    }
+
+    fprintf(gro, "%10.5f%10.5f%10.5f\n", box_xy, box_xy, box_z);
+
+    free(lipid_species);
+    fclose(gro);
+    fclose(ndx);
+    return 0;
+}
@@ -0,0 +1,73 @@
+#!/bin/sh
+# Released under MIT License.
+# Copyright (c) 2023 Ladislav Bartos
+
+# Scaling benchmark of leaflets2ndx.
+# Usage: bench/run_bench.sh [LIPID_COUNT]...
+#
+# For each lipid count, generates a synthetic bilayer using gen_membrane, runs leaflets2ndx with --timings
+# and prints the time spent per atom in each phase (ns/atom) and the throughput of the write phase (MB/s).
+#
+# Environment variables:
+#   LEAFLETS2NDX   path to the leaflets2ndx binary (default: ./leaflets2ndx)
+#   GEN_MEMBRANE   path to the generator (default: ./bench/gen_membrane)
+#   MIX            species mix passed to the generator (default: POPC:2,DOPE:1,CHOL:1)
+#   ALL_ATOM       if set to 1, lipid heads use all-atom naming
+#   HEADS          selection of lipid heads (default: matches the heads of the generated species)
+#   BENCH_DIR      directory for the generated files (default: temporary directory)
+#   LEAFLETS_ARGS  additional arguments passed to leaflets2ndx
+
+LEAFLETS2NDX=${LEAFLETS2NDX:-./leaflets2ndx}
+GEN_MEMBRANE=${GEN_MEMBRANE:-./bench/gen_membrane}
+MIX=${MIX:-POPC:2,DOPE:1,CHOL:1}
+
+if [ "$#" -eq 0 ]; then
+    set -- 1000 10000 100000 1000000 10000000
+fi
+
+if [ "${ALL_ATOM:-0}" = "1" ]; then
+    GEN_FLAGS="-a"
+    HEADS=${HEADS:-name P O3}
+else
+    GEN_FLAGS=""
+    HEADS=${HEADS:-name PO4 ROH}
+fi
+
+CLEANUP=0
+if [ -z "${BENCH_DIR}" ]; then
+    BENCH_DIR=$(mktemp -d) || exit 1
+    CLEANUP=1
+fi
+
+printf "%-10s %-11s %-16s %12s\n" "lipids" "atoms" "phase" "ns/atom"
+
+for LIPIDS in "$@"; do
+    PREFIX="${BENCH_DIR}/membrane_${LIPIDS}"
+    "${GEN_MEMBRANE}" -l "${LIPIDS}" -m "${MIX}" ${GEN_FLAGS} -o "${PREFIX}" || exit 1
+    rm -f "${PREFIX}_out.ndx"
+
+    # shellcheck disable=SC2086
+    "${LEAFLETS2NDX}" -c "${PREFIX}.gro" -n "${PREFIX}.ndx" -p "${HEADS}" -o "${PREFIX}_out.ndx" \
+        --timings ${LEAFLETS_ARGS} 2> "${PREFIX}_timings.txt" || { cat "${PREFIX}_timings.txt"; exit 1; }
+
+    BYTES=$(wc -c < "${PREFIX}_out.ndx")
+    ATOMS=$(awk '$1 == "load_gro" { print $3 }' "${PREFIX}_timings.txt")
+
+    awk -v lipids="${LIPIDS}" -v atoms="${ATOMS}" -v bytes="${BYTES}" '
+        NR > 1 {
+            ns_per_atom = (atoms > 0) ? $2 * 1e9 / atoms : 0
+            printf "%-10s %-11s %-16s %12.2f\n", lipids, atoms, $1, ns_per_atom
+            if ($1 == "write" && $2 > 0) write_mbps = bytes / $2 / 1e6
+        }
+        END {
+            printf "%-10s %-11s %-16s %12.1f MB/s\n", lipids, atoms, "write_throughput", write_mbps
+        }' "${PREFIX}_timings.txt"
+
+    if [ "${CLEANUP}" -eq 1 ]; then
+        rm -f "${PREFIX}.gro" "${PREFIX}.ndx" "${PREFIX}_out.ndx" "${PREFIX}_timings.txt"
+    fi
+done
+
+if [ "${CLEANUP}" -eq 1 ]; then
+    rmdir "${BENCH_DIR}"
+fi
@@ -0,0 +1,57 @@
+#!/bin/sh
+# Released under MIT License.
+# Copyright (c) 2023 Ladislav Bartos
+
+# Comparison of the optimized code paths of leaflets2ndx with the original implementations.
+# Usage: bench/run_compare.sh [LIPID_COUNT]...
+#
+# For each lipid count, generates a synthetic bilayer using gen_membrane and runs bench/compare on it,
+# which reports time (s, ns/atom) and number of memory allocations of the original (baseline)
+# and the current implementation of each compared code path.
+#
+# Environment variables:
+#   COMPARE        path to the comparison binary (default: ./bench/compare)
+#   GEN_MEMBRANE   path to the generator (default: ./bench/gen_membrane)
+#   MIX            species mix passed to the generator (default: POPC:2,DOPE:1,CHOL:1)
+#   ALL_ATOM       if set to 1, lipid heads use all-atom naming
+#   HEADS          selection of lipid heads (default: matches the heads of the generated species)
+#   BENCH_DIR      directory for the generated files (default: temporary directory)
+
+COMPARE=${COMPARE:-./bench/compare}
+GEN_MEMBRANE=${GEN_MEMBRANE:-./bench/gen_membrane}
+MIX=${MIX:-POPC:2,DOPE:1,CHOL:1}
+
+if [ "$#" -eq 0 ]; then
+    set -- 1000 100000 1000000
+fi
+
+if [ "${ALL_ATOM:-0}" = "1" ]; then
+    GEN_FLAGS="-a"
+    HEADS=${HEADS:-name P O3}
+else
+    GEN_FLAGS=""
+    HEADS=${HEADS:-name PO4 ROH}
+fi
+
+CLEANUP=0
+if [ -z "${BENCH_DIR}" ]; then
+    BENCH_DIR=$(mktemp -d) || exit 1
+    CLEANUP=1
+fi
+
+for LIPIDS in "$@"; do
+    PREFIX="${BENCH_DIR}/membrane_${LIPIDS}"
+    "${GEN_MEMBRANE}" -l "${LIPIDS}" -m "${MIX}" ${GEN_FLAGS} -o "${PREFIX}" || exit 1
+
+    echo "# ${LIPIDS} lipids"
+    "${COMPARE}" "${PREFIX}.gro" "${PREFIX}.ndx" "Membrane" "${HEADS}" || exit 1
+    echo
+
+    if [ "${CLEANUP}" -eq 1 ]; then
+        rm -f "${PREFIX}.gro" "${PREFIX}.ndx"
+    fi
+done
+
+if [ "${CLEANUP}" -eq 1 ]; then
+    rmdir "${BENCH_DIR}"
+fi
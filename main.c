@@ -1,11 +1,34 @@
 // Released under MIT License.
 // Copyright (c) 2023 Ladislav Bartos
 
-// version 1.1.0
+// version 1.2.0
 
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <getopt.h>
+#include <time.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <glob.h>
+#include <limits.h>
+#include <zlib.h>
+#ifdef LEAFLETS2NDX_ZSTD
+#include <zstd.h>
+#endif
 #include <groan.h>
 
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
 void destroy_selections(atom_selection_t **selections, const size_t n)
 {
     for (size_t i = 0; i < n; ++i) {
@@ -15,6 +38,35 @@ void destroy_selections(atom_selection_t **selections, const size_t n)
     free(selections);
 }
 
+/*
+ * Methods of assigning lipids into leaflets.
+ */
+typedef enum method {
+    METHOD_GLOBAL,      // compare lipid heads to the center of the whole membrane
+    METHOD_GRID,        // compare lipid heads to a local membrane midplane
+    METHOD_CLUSTER,     // cluster lipid heads into connected leaflets
+    METHOD_STACK,       // detect any number of leaflets along the membrane normal
+} method_t;
+
+/*
+ * Value of `classification_t.normal` requesting automatic detection of the membrane normal.
+ */
+#define NORMAL_AUTO -1
+
+/*
+ * Settings of the leaflet assignment.
+ */
+typedef struct classification {
+    method_t method;
+    int normal;         // axis of the membrane normal (x, y, z) or NORMAL_AUTO
+    size_t grid;        // number of grid cells along the axes perpendicular to the normal (METHOD_GRID)
+    float cutoff;       // distance cutoff for lipid heads in one leaflet (METHOD_CLUSTER)
+    float gap;          // minimal gap between leaflets along the normal (METHOD_STACK)
+    size_t n_threads;   // number of threads used to calculate the membrane center
+    int com;            // use center of mass instead of center of geometry
+    char *masses;       // file with masses of atoms overriding the guessed masses (optional)
+} classification_t;
+
 /*
  * Parses command line arguments.
  * Returns zero, if parsing has been successful. Else returns non-zero.
@@ -24,20 +76,47 @@ int get_arguments(
         char **argv,
         char **gro_file,
         char **ndx_file,
+        char **traj_file,
         char **output_file,
         char **selection,
         char **phosphate,
-        int *empty) 
+        int *empty,
+        size_t *n_threads,
+        int *timings,
+        int *ndx_cache,
+        int *replace,
+        list_t *batch_patterns,
+        char **batch_list,
+        int *split,
+        char **topology_cache,
+        classification_t *classification) 
 {
     int gro_specified = 0;
 
+    static struct option long_options[] = {
+        {"timings", optional_argument, NULL, 'T'},
+        {"ndx-cache", no_argument, NULL, 'C'},
+        {"replace", no_argument, NULL, 'R'},
+        {"com", no_argument, NULL, 'W'},
+        {"masses", required_argument, NULL, 'A'},
+        {"batch", required_argument, NULL, 'B'},
+        {"batch-list", required_argument, NULL, 'L'},
+        {"split", no_argument, NULL, 'S'},
+        {"topology-cache", required_argument, NULL, 'O'},
+        {"grid", required_argument, NULL, 'G'},
+        {"cluster", required_argument, NULL, 'K'},
+        {"normal", required_argument, NULL, 'N'},
+        {"stack", required_argument, NULL, 'M'},
+        {NULL, 0, NULL, 0}
+    };
+
     int opt = 0;
-    while((opt = getopt(argc, argv, "c:n:o:s:p:eh")) != -1) {
+    while((opt = getopt_long(argc, argv, "c:n:f:o:s:p:t:eh", long_options, NULL)) != -1) {
         switch (opt) {
         // help
         case 'h':
             return 1;
-        // gro file to read
+        // gro file to read; '-' is standard input
         case 'c':
             *gro_file = optarg;
             gro_specified = 1;
@@ -46,9 +125,13 @@ int get_arguments(
         case 'n':
             *ndx_file = optarg;
             break;
-        // output file name
+        // trajectory file to read
+        case 'f':
+            *traj_file = optarg;
+            break;
+        // output file name; '-' is standard output
         case 'o':
-            *output_file = optarg;
+            *output_file = strcmp(optarg, "-") == 0 ? NULL : optarg;
             break;
         // selected atoms
         case 's':
@@ -62,276 +145,4329 @@ int get_arguments(
         case 'e':
             *empty = 1;
             break;
+        // number of threads
+        case 't':
+            if (atoi(optarg) <= 0) {
+                fprintf(stderr, "Number of threads must be a positive integer.\n");
+                return 1;
+            }
+            *n_threads = (size_t) atoi(optarg);
+            break;
+        // report timings of individual phases
+        case 'T':
+            if (optarg == NULL || strcmp(optarg, "table") == 0) *timings = 1;
+            else if (strcmp(optarg, "json") == 0) *timings = 2;
+            else {
+                fprintf(stderr, "Unknown format of timings '%s'.\n", optarg);
+                return 1;
+            }
+            break;
+        // use binary sidecar of the ndx file
+        case 'C':
+            *ndx_cache = 1;
+            break;
+        // replace the output file instead of appending to it
+        case 'R':
+            *replace = 1;
+            break;
+        // gro files processed in batch mode
+        case 'B':
+            list_append(batch_patterns, optarg);
+            break;
+        // file containing list of gro files processed in batch mode
+        case 'L':
+            *batch_list = optarg;
+            break;
+        // write ndx groups of each gro file processed in batch mode into a separate file
+        case 'S':
+            *split = 1;
+            break;
+        // file caching the lipid topology
+        case 'O':
+            *topology_cache = optarg;
+            break;
+        // classify lipids using local membrane midplane
+        case 'G':
+            if (atoi(optarg) <= 0) {
+                fprintf(stderr, "Number of grid cells must be a positive integer.\n");
+                return 1;
+            }
+            classification->method = METHOD_GRID;
+            classification->grid = (size_t) atoi(optarg);
+            break;
+        // classify lipids by clustering their heads
+        case 'K':
+            if (atof(optarg) <= 0.0) {
+                fprintf(stderr, "Clustering cutoff must be a positive number.\n");
+                return 1;
+            }
+            classification->method = METHOD_CLUSTER;
+            classification->cutoff = (float) atof(optarg);
+            break;
+        // weight the membrane center by atomic masses
+        case 'W':
+            classification->com = 1;
+            break;
+        // file with masses of atoms; implies --com
+        case 'A':
+            classification->com = 1;
+            classification->masses = optarg;
+            break;
+        // detect leaflets of stacked membranes
+        case 'M':
+            if (atof(optarg) <= 0.0) {
+                fprintf(stderr, "Gap between leaflets must be a positive number.\n");
+                return 1;
+            }
+            classification->method = METHOD_STACK;
+            classification->gap = (float) atof(optarg);
+            break;
+        // orientation of the membrane normal
+        case 'N':
+            if (!strcmp(optarg, "x")) classification->normal = x;
+            else if (!strcmp(optarg, "y")) classification->normal = y;
+            else if (!strcmp(optarg, "z")) classification->normal = z;
+            else if (!strcmp(optarg, "auto")) classification->normal = NORMAL_AUTO;
+            else {
+                fprintf(stderr, "Membrane normal must be one of x, y, z, auto.\n");
+                return 1;
+            }
+            break;
         default:
             //fprintf(stderr, "Unknown command line option: %c.\n", opt);
             return 1;
         }
     }
 
-    if (!gro_specified) {
+    // remaining arguments are also gro files processed in batch mode
+    int batch = batch_patterns->n_items > 0 || *batch_list != NULL || optind < argc;
+    if (batch) {
+        for (; optind < argc; ++optind) list_append(batch_patterns, argv[optind]);
+    }
+
+    if (!gro_specified && !batch) {
         fprintf(stderr, "Gro file must always be supplied.\n");
         return 1;
     }
+
+    if (batch && *traj_file != NULL) {
+        fprintf(stderr, "Trajectory cannot be processed in batch mode.\n");
+        return 1;
+    }
+
+    if (*split && (!batch || *output_file != NULL)) {
+        fprintf(stderr, "Flag --split can only be used in batch mode without an output file.\n");
+        return 1;
+    }
+
+    if (*replace && *output_file == NULL && !*split) {
+        fprintf(stderr, "Flag --replace requires an output file.\n");
+        return 1;
+    }
     return 0;
 }
 
 void print_usage(const char *program_name)
 {
-    printf("Usage: %s -c GRO_FILE [OPTION]...\n", program_name);
+    printf("Usage: %s -c GRO_FILE [OPTION]... [GRO_FILE]...\n", program_name);
     printf("\nOPTIONS\n");
     printf("-h               print this message and exit\n");
-    printf("-c STRING        gro file to read\n");
+    printf("-c STRING        gro file to read ('-' for standard input)\n");
     printf("-n STRING        ndx file to read (optional, default: index.ndx)\n");
+    printf("-f STRING        xtc or trr trajectory to read (optional)\n");
     printf("-s STRING        selection of membrane lipids (default: Membrane)\n");
     printf("-p STRING        selection of lipid head identifiers (default: name PO4)\n");
-    printf("-o STRING        output ndx file (optional)\n");
+    printf("-o STRING        output ndx file ('-' for standard output) (optional)\n");
     printf("-e               also create empty ndx groups (optional)\n");
+    printf("-t INTEGER       number of threads used to read gro file, calculate membrane center and process trajectory frames (default: 1)\n");
+    printf("--timings[=json] report time spent in individual phases to stderr (optional)\n");
+    printf("--ndx-cache      read ndx groups from a binary sidecar NDX_FILE.idx, creating it if needed (optional)\n");
+    printf("--replace        replace the output file instead of appending to it (optional)\n");
+    printf("--batch STRING   gro files (glob pattern) processed in batch mode, repeatable (optional)\n");
+    printf("--batch-list STRING\n");
+    printf("                 file listing gro files processed in batch mode (optional)\n");
+    printf("--split          write ndx groups of each batch gro file into a separate ndx file (optional)\n");
+    printf("--topology-cache STRING\n");
+    printf("                 file caching the selected lipids and their heads, created if needed (optional)\n");
+    printf("--grid INTEGER   classify lipids using local midplane of INTEGER x INTEGER xy cells (optional)\n");
+    printf("--cluster FLOAT  classify lipids by clustering their heads using FLOAT cutoff [nm] (optional)\n");
+    printf("--normal STRING  membrane normal: x, y, z or auto (default: z)\n");
+    printf("--stack FLOAT    detect any number of leaflets separated by at least FLOAT nm along the normal (optional)\n");
+    printf("--com            use center of mass of the membrane instead of center of geometry (optional)\n");
+    printf("--masses STRING  file with masses of atoms overriding the guessed masses, implies --com (optional)\n");
     printf("\n");
 }
 
-void write_ndx_group(FILE *stream, const char *name, const atom_selection_t *selection)
+/*
+ * Phases of the program measured by --timings.
+ */
+typedef enum phase {
+    PHASE_LOAD_GRO,
+    PHASE_READ_NDX,
+    PHASE_SELECT_MEMBRANE,
+    PHASE_SELECT_HEADS,
+    PHASE_SPLIT_RESIDUES,
+    PHASE_TOPOLOGY_CACHE,
+    PHASE_READ_FRAMES,
+    PHASE_CENTER,
+    PHASE_CLASSIFY,
+    PHASE_WRITE,
+    N_PHASES
+} phase_t;
+
+static const char *PHASE_NAMES[N_PHASES] = {
+    "load_gro", "read_ndx", "select_membrane", "select_heads", "split_residues",
+    "topology_cache", "read_frames", "center", "classify", "write"
+};
+
+/*
+ * Wall time spent in each phase and the number of atoms processed by it.
+ */
+typedef struct timings {
+    double seconds[N_PHASES];
+    size_t atoms[N_PHASES];
+} timings_t;
+
+/*
+ * Returns the current value of the monotonic clock in seconds.
+ */
+static double monotonic_seconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) now.tv_sec + (double) now.tv_nsec * 1e-9;
+}
+
+/*
+ * Adds time elapsed since `start` and the number of processed atoms to the phase.
+ */
+static void timings_add(timings_t *timings, const phase_t phase, const double start, const size_t atoms)
 {
-    fprintf(stream, "[ %s ]\n", name);
-    for (size_t i = 0; i < selection->n_atoms; ++i) {
-        fprintf(stream, "%4ld ", selection->atoms[i]->gmx_atom_number);
+    timings->seconds[phase] += monotonic_seconds() - start;
+    timings->atoms[phase] += atoms;
+}
 
-        if ((i + 1) % 15 == 0 || i + 1 == selection->n_atoms) fprintf(stream, "\n");
+static void timings_merge(timings_t *timings, timings_t *add)
+{
+    for (int i = 0; i < N_PHASES; ++i) {
+        timings->seconds[i] += add->seconds[i];
+        timings->atoms[i] += add->atoms[i];
     }
+    memset(add, 0, sizeof(timings_t));
 }
 
-/*! @brief Creates ndx groups for lipids distinguishing between membrane leaflets. Returns the number of ndx groups or 0 if no groups were created. */
-size_t create_groups(
-        const atom_selection_t *membrane, 
-        const atom_selection_t *phosphates,
-        const list_t *residue_names,
-        atom_selection_t ***ndx_groups,
-        box_t box) 
+/*
+ * Prints the timings as a table or, if `json` is non-zero, as a JSON object.
+ */
+void timings_print(FILE *stream, const timings_t *timings, const double total, const int json)
 {
-    // split lipid atoms into individual residues
-    atom_selection_t **residues = NULL;
-    size_t n_residues = selection_splitbyres(membrane, &residues);
+    if (json) fprintf(stream, "{\"total_s\": %.6f, \"phases\": {", total);
+    else fprintf(stream, "%-16s %12s %12s %14s\n", "phase", "time [s]", "atoms", "atoms/s");
 
-    if (residues == NULL || n_residues == 0) {
-        free(residues);
-        fprintf(stderr, "Could not split atoms based on residue number.\n");
-        return 0;
+    for (int i = 0; i < N_PHASES; ++i) {
+        double throughput = timings->seconds[i] > 0.0 ? timings->atoms[i] / timings->seconds[i] : 0.0;
+        if (json) {
+            fprintf(stream, "%s\"%s\": {\"time_s\": %.6f, \"atoms\": %zu, \"atoms_per_s\": %.1f}",
+                    i == 0 ? "" : ", ", PHASE_NAMES[i], timings->seconds[i], timings->atoms[i], throughput);
+        } else {
+            fprintf(stream, "%-16s %12.6f %12zu %14.4g\n", PHASE_NAMES[i], timings->seconds[i], timings->atoms[i], throughput);
+        }
     }
 
-    // calculate membrane center
-    vec_t center = {0.0};
-    if (center_of_geometry(membrane, center, box) != 0) {
-        fprintf(stderr, "Could not calculate center of geometry for membrane lipids.\n");
-        destroy_selections(residues, n_residues);
-        return 0;
+    if (json) fprintf(stream, "}}\n");
+    else fprintf(stream, "%-16s %12.6f\n", "total", total);
+}
+
+/*
+ * Checks whether the string ends with the given suffix.
+ */
+static int ends_with(const char *string, const char *suffix)
+{
+    size_t length = strlen(string);
+    size_t suffix_length = strlen(suffix);
+    return length >= suffix_length && strcmp(string + length - suffix_length, suffix) == 0;
+}
+
+/*
+ * Checks whether the file is compressed based on its extension (.gz or .zst).
+ */
+static int is_compressed(const char *filename)
+{
+    return ends_with(filename, ".gz") || ends_with(filename, ".zst");
+}
+
+/*
+ * Writes all `size` bytes of `data` into the file descriptor.
+ * Returns zero, if successful. Else returns non-zero.
+ */
+static int write_all(const int fd, const char *data, const size_t size)
+{
+    size_t written = 0;
+    while (written < size) {
+        ssize_t n = write(fd, data + written, size - written);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 1;
+        written += (size_t) n;
     }
 
-    // allocate memory for ndx_groups
-    size_t n_groups = residue_names->n_items * 2;
-    *ndx_groups = calloc(n_groups, sizeof(atom_selection_t *));
-    size_t *allocated = calloc(n_groups, sizeof(size_t));
+    return 0;
+}
 
-    for (size_t i = 0; i < n_groups; ++i) {
-        allocated[i] = 64;
-        (*ndx_groups)[i] = selection_create(allocated[i]);
+#define NDX_WRITER_BUFFER_SIZE (1 << 20)
+
+/*
+ * Buffered writer of ndx groups writing large chunks directly into a file descriptor.
+ * If the output is compressed, the chunks are passed through a streaming compressor instead.
+ * Atomic writers keep filled chunks in memory and write them all at once when a block of groups is committed.
+ * Writers without a file descriptor (fd < 0) collect all the output in a growing memory buffer.
+ */
+typedef struct ndx_writer {
+    int fd;
+    int owns_fd;            // the file descriptor is closed when the writer is destroyed
+    int error;
+    size_t used;
+    size_t capacity;
+    char *buffer;
+    int atomic;             // output is only written by ndx_writer_commit
+    struct iovec *chunks;   // filled chunks of an atomic writer waiting for the commit
+    size_t n_chunks;
+    size_t allocated_chunks;
+    const char *path;       // path of the output file replaced by `temporary` once the writer is destroyed
+    char *temporary;
+    int created;            // the output file did not exist before it was opened by this writer
+    size_t written;         // number of uncompressed bytes written into the output file by this writer
+    gzFile gz;              // gzip compressor writing into fd
+#ifdef LEAFLETS2NDX_ZSTD
+    ZSTD_CStream *zstd;     // zstd compressor writing into fd
+    char *compressed;       // output buffer of the zstd compressor
+#endif
+} ndx_writer_t;
+
+static ndx_writer_t *ndx_writer_alloc(const int fd, const size_t capacity)
+{
+    ndx_writer_t *writer = calloc(1, sizeof(ndx_writer_t));
+    if (writer == NULL) return NULL;
+
+    writer->buffer = malloc(capacity);
+    if (writer->buffer == NULL) {
+        free(writer);
+        return NULL;
     }
 
-    // loop through all the residues
-    for (size_t i = 0; i < n_residues; ++i) {
-        char *resname = residues[i]->atoms[0]->residue_name;
+    writer->fd = fd;
+    writer->capacity = capacity;
 
-        // get lipid phosphate
-        atom_selection_t *phosphate = selection_intersect(residues[i], phosphates);
-        if (phosphate == NULL || phosphate->n_atoms <= 0) {
-            fprintf(stderr, "No phosphate detected for lipid %s (resid %d).\n", resname, residues[i]->atoms[0]->residue_number);
-            free(phosphate);
-            free(allocated);
-            destroy_selections(residues, n_residues);
-            destroy_selections(*ndx_groups, n_groups);
-            *ndx_groups = NULL;
-            return 0;
-        }
-        if (phosphate->n_atoms > 1) {
-            fprintf(stderr, "Multiple phosphates detected for lipid %s (resid %d).\n", resname, residues[i]->atoms[0]->residue_number);
-            free(phosphate);
-            free(allocated);
-            destroy_selections(residues, n_residues);
-            destroy_selections(*ndx_groups, n_groups);
-            *ndx_groups = NULL;
-            return 0;
-        }
+    return writer;
+}
 
-        // assign lipid into leaflet
-        // 1 -> upper, 0 -> lower
-        atom_t *pho = phosphate->atoms[0];
-        size_t classification = 0;
-        if (distance1D(pho->position, center, z, box) > 0) classification = 1;
+/*
+ * Creates a temporary file next to `path` which can later replace it.
+ * The temporary file gets the permissions of `path` or, if `path` does not exist, the default permissions of new files.
+ * Returns file descriptor of the temporary file and stores its path in `temporary` or returns -1 if the file could not be created.
+ */
+static int create_replacement(const char *path, char **temporary)
+{
+    *temporary = malloc(strlen(path) + 8);
+    if (*temporary == NULL) return -1;
+    sprintf(*temporary, "%s.XXXXXX", path);
 
-        // assign lipid into an ndx group
-        int index = list_index(residue_names, resname);
-        if (index < 0) {
-            fprintf(stderr, "Internal Error. Inconsistency in residue names. Residue name %s of resid %d was not found in a list of detected residue names.\n", resname, residues[i]->atoms[0]->residue_number);
-            fprintf(stderr, "This should never happen.\n");
-            free(phosphate);
-            free(allocated);
+    int fd = mkstemp(*temporary);
+    if (fd < 0) {
+        free(*temporary);
+        *temporary = NULL;
+        return -1;
+    }
 
-            destroy_selections(residues, n_residues);
-            destroy_selections(*ndx_groups, n_groups);
-            *ndx_groups = NULL;
-            return 0;
-        }
+    struct stat info;
+    mode_t mode = 0;
+    if (stat(path, &info) == 0) {
+        mode = info.st_mode & 07777;
+    } else {
+        mode_t mask = umask(0);
+        umask(mask);
+        mode = 0666 & ~mask;
+    }
+    fchmod(fd, mode);
 
-        selection_add(&((*ndx_groups)[2 * index + classification]), &allocated[2 * index + classification], residues[i]);
+    return fd;
+}
+
+/*
+ * Opens the output ndx file for writing. If the file exists, the output is appended to it.
+ * Uncompressed output is written atomically: every committed block of ndx groups is appended using a single writev,
+ * so the output of concurrent processes appending to the same file never interleaves.
+ * If `replace` is non-zero, the output is written into a temporary file which replaces the output file once the writer is destroyed.
+ * Output into files ending with .gz (or .zst, if compiled with zstd support) is compressed on the fly;
+ * appended output forms a new gzip member or zstd frame, so the file remains valid.
+ * If `filename` is NULL, the output is written (uncompressed) into standard output.
+ * Returns pointer to the writer or NULL if the file could not be opened.
+ */
+ndx_writer_t *ndx_writer_open(const char *filename, const int replace)
+{
+    if (filename == NULL) {
+        fflush(stdout);
+        return ndx_writer_alloc(STDOUT_FILENO, NDX_WRITER_BUFFER_SIZE);
+    }
 
-        free(phosphate);
+#ifndef LEAFLETS2NDX_ZSTD
+    if (ends_with(filename, ".zst")) {
+        fprintf(stderr, "Writing zstd-compressed output requires leaflets2ndx compiled with zstd support.\n");
+        return NULL;
     }
+#endif
 
-    free(allocated);
-    destroy_selections(residues, n_residues);
+    char *temporary = NULL;
+    int created = 0;
+    int fd = -1;
+    if (replace) fd = create_replacement(filename, &temporary);
+    else {
+        // remember whether the file is new, so that it can be removed if the program fails
+        fd = open(filename, O_WRONLY | O_CREAT | O_EXCL | O_APPEND, 0666);
+        if (fd >= 0) created = 1;
+        else if (errno == EEXIST) fd = open(filename, O_WRONLY | O_APPEND);
+    }
+    if (fd < 0) return NULL;
 
-    return n_groups;
+    ndx_writer_t *writer = ndx_writer_alloc(fd, NDX_WRITER_BUFFER_SIZE);
+    if (writer == NULL) {
+        close(fd);
+        if (temporary != NULL) unlink(temporary);
+        free(temporary);
+        return NULL;
+    }
+    writer->owns_fd = 1;
+    writer->path = filename;
+    writer->temporary = temporary;
+    writer->created = created;
+    // a replacement is invisible until it is renamed, so it can be written continuously
+    writer->atomic = !replace && !is_compressed(filename);
+
+    if (ends_with(filename, ".gz")) {
+        // the gzip stream takes over the file descriptor
+        writer->gz = gzdopen(fd, "wb");
+        if (writer->gz == NULL) goto open_failed;
+        writer->owns_fd = 0;
+        gzbuffer(writer->gz, NDX_WRITER_BUFFER_SIZE);
+    }
 
+#ifdef LEAFLETS2NDX_ZSTD
+    if (ends_with(filename, ".zst")) {
+        writer->zstd = ZSTD_createCStream();
+        writer->compressed = malloc(ZSTD_CStreamOutSize());
+        if (writer->zstd == NULL || writer->compressed == NULL || ZSTD_isError(ZSTD_initCStream(writer->zstd, 3))) goto open_failed;
+    }
+#endif
 
+    return writer;
 
+    open_failed:
+    if (writer->gz != NULL) gzclose(writer->gz);
+    else close(fd);
+    if (temporary != NULL) unlink(temporary);
+    if (created) unlink(filename);
+    free(temporary);
+#ifdef LEAFLETS2NDX_ZSTD
+    ZSTD_freeCStream(writer->zstd);
+    free(writer->compressed);
+#endif
+    free(writer->buffer);
+    free(writer);
+    return NULL;
 }
 
-int main(int argc, char **argv)
+/*
+ * Creates a writer collecting the output in memory.
+ * Returns pointer to the writer or NULL if memory could not be allocated.
+ */
+ndx_writer_t *ndx_writer_create_memory(void)
 {
-    // get arguments
-    char *gro_file = NULL;
-    char *ndx_file = "index.ndx";
-    char *output_file = NULL;
-    char *selected = "Membrane";
-    char *phosphate = "name PO4";
-    int empty = 0;
+    return ndx_writer_alloc(-1, 4096);
+}
 
-    int return_code = 0;
+#ifdef LEAFLETS2NDX_ZSTD
+/*
+ * Passes the buffered data through the zstd compressor. If `finish` is non-zero, the zstd frame is also completed.
+ * Returns zero, if successful. Else returns non-zero.
+ */
+static int ndx_writer_compress(ndx_writer_t *writer, const int finish)
+{
+    ZSTD_inBuffer input = { writer->buffer, writer->used, 0 };
+    size_t remaining = finish;
+    while (input.pos < input.size || remaining != 0) {
+        ZSTD_outBuffer output = { writer->compressed, ZSTD_CStreamOutSize(), 0 };
+        if (input.pos < input.size) remaining = ZSTD_compressStream(writer->zstd, &output, &input);
+        else remaining = ZSTD_endStream(writer->zstd, &output);
 
-    if (get_arguments(argc, argv, &gro_file, &ndx_file, &output_file, &selected, &phosphate, &empty) != 0) {
-        print_usage(argv[0]);
-        return 1;
+        if (ZSTD_isError(remaining) || write_all(writer->fd, writer->compressed, output.pos) != 0) return 1;
+        if (!finish && input.pos == input.size) remaining = 0;
     }
-    
-    // read gro file
-    system_t *system = load_gro(gro_file);
-    if (system == NULL) return 1;
 
-    // read ndx file; ignore if this fails
-    dict_t *ndx_groups = read_ndx(ndx_file, system);
+    return 0;
+}
+#endif
+
+/*
+ * Writes all chunks of an atomic writer together with the current buffer using a single writev call.
+ * Only if the output is larger than IOV_MAX chunks or the write is interrupted, more calls are needed.
+ * Returns zero, if successful. Else returns non-zero.
+ */
+static int ndx_writer_writev(ndx_writer_t *writer)
+{
+    // the chunk array always has room for the current buffer
+    struct iovec *iov = writer->chunks;
+    size_t n_iov = writer->n_chunks;
+    iov[n_iov].iov_base = writer->buffer;
+    iov[n_iov].iov_len = writer->used;
+    ++n_iov;
 
-    // select all atoms
-    atom_selection_t *all = select_system(system);
+    while (n_iov > 0) {
+        if (iov->iov_len == 0) {
+            ++iov;
+            --n_iov;
+            continue;
+        }
 
-    // select membrane lipids
-    atom_selection_t *membrane = smart_select(all, selected, ndx_groups);
-    if (membrane == NULL) {
-        fprintf(stderr, "Could not understand the selection query '%s'.\n", selected);
+        ssize_t n = writev(writer->fd, iov, (int) (n_iov < IOV_MAX ? n_iov : IOV_MAX));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 1;
 
-        dict_destroy(ndx_groups);
-        free(all);
-        free(system);
-        return 1;
+        // skip the written data
+        size_t written = (size_t) n;
+        while (n_iov > 0 && written >= iov->iov_len) {
+            written -= iov->iov_len;
+            ++iov;
+            --n_iov;
+        }
+        if (written > 0) {
+            iov->iov_base = (char *) iov->iov_base + written;
+            iov->iov_len -= written;
+        }
     }
 
-    if (membrane->n_atoms == 0) {
-        fprintf(stderr, "No membrane lipids ('%s') found.\n", selected);
+    return 0;
+}
 
-        dict_destroy(ndx_groups);
-        free(membrane);
-        free(system);
-        free(all);
-        return 1;
+/*
+ * Frees chunks of an atomic writer.
+ */
+static void ndx_writer_free_chunks(ndx_writer_t *writer)
+{
+    for (size_t i = 0; i < writer->n_chunks; ++i) free(writer->chunks[i].iov_base);
+    writer->n_chunks = 0;
+}
+
+/*
+ * Moves the filled buffer of an atomic writer into the list of chunks and starts a new buffer.
+ */
+static void ndx_writer_stash(ndx_writer_t *writer)
+{
+    if (writer->error) {
+        writer->used = 0;
+        return;
     }
 
-    // select phosphates
-    atom_selection_t *phosphates = smart_select(all, phosphate, ndx_groups);
-    if (phosphates == NULL || phosphates->n_atoms == 0) {
-        fprintf(stderr, "No phosphates ('%s') found.\n", phosphate);
+    char *buffer = malloc(NDX_WRITER_BUFFER_SIZE);
+    if (writer->n_chunks + 1 >= writer->allocated_chunks) {
+        size_t allocated = writer->allocated_chunks == 0 ? 16 : writer->allocated_chunks * 2;
+        struct iovec *chunks = realloc(writer->chunks, allocated * sizeof(struct iovec));
+        if (chunks != NULL) {
+            writer->chunks = chunks;
+            writer->allocated_chunks = allocated;
+        }
+    }
 
-        dict_destroy(ndx_groups);
-        free(phosphates);
-        free(membrane);
-        free(all);
-        free(system);
-        return 1;
+    if (buffer == NULL || writer->n_chunks + 1 >= writer->allocated_chunks) {
+        // drop the data; the error is reported when the writer is committed
+        free(buffer);
+        ndx_writer_free_chunks(writer);
+        writer->error = 1;
+        writer->used = 0;
+        return;
     }
 
-    // get residue names
-    list_t *residue_names = selection_getresnames(membrane);
+    writer->chunks[writer->n_chunks].iov_base = writer->buffer;
+    writer->chunks[writer->n_chunks].iov_len = writer->used;
+    ++writer->n_chunks;
 
-    // create new ndx groups
-    atom_selection_t **lipids_leaflets = NULL;
-    size_t n_groups = 0;
-    if ( (n_groups = create_groups(membrane, phosphates, residue_names, &lipids_leaflets, system->box)) == 0) {
-        fprintf(stderr, "Failed to create ndx groups.\n");
-        return_code = 1;
-        goto main_end;
-    }
+    writer->buffer = buffer;
+    writer->capacity = NDX_WRITER_BUFFER_SIZE;
+    writer->used = 0;
+}
 
-    // open the output file
-    FILE *output = NULL;
-    FILE *test = NULL;
-    if (output_file == NULL) output = stdout;
-    // if the file exists, append
-    else if ((test = fopen(output_file, "r")) != NULL) {
-        fclose(test);
-        output = fopen(output_file, "a");
-    } else {
-        output = fopen(output_file, "w");
+/*
+ * Writes all buffered data into the file descriptor, compressing them if needed. Does nothing for memory writers.
+ * Returns zero, if successful. Else returns non-zero.
+ */
+int ndx_writer_flush(ndx_writer_t *writer)
+{
+    if (writer->fd < 0) return writer->error;
+
+    if (!writer->error && (writer->used > 0 || writer->n_chunks > 0)) {
+        if (writer->gz != NULL) writer->error = gzwrite(writer->gz, writer->buffer, (unsigned) writer->used) != (int) writer->used;
+#ifdef LEAFLETS2NDX_ZSTD
+        else if (writer->zstd != NULL) writer->error = ndx_writer_compress(writer, 0);
+#endif
+        else {
+            size_t size = writer->used;
+            for (size_t i = 0; i < writer->n_chunks; ++i) size += writer->chunks[i].iov_len;
+
+            if (writer->atomic && writer->chunks != NULL) writer->error = ndx_writer_writev(writer);
+            else writer->error = write_all(writer->fd, writer->buffer, writer->used);
+            if (!writer->error) writer->written += size;
+        }
     }
 
-    if (output == NULL) {
-        fprintf(stderr, "The output ndx file could not be opened.\n");
-        return_code = 1;
-        goto main_end;
+    ndx_writer_free_chunks(writer);
+    writer->used = 0;
+    return writer->error;
+}
+
+/*
+ * Marks the end of a block of ndx groups (e.g. all groups of a frame) which must not be interleaved with the output
+ * of other processes. Atomic writers write the whole block now; other writers continue buffering.
+ * Returns zero, if all the data have been successfully written so far. Else returns non-zero.
+ */
+int ndx_writer_commit(ndx_writer_t *writer)
+{
+    if (writer->atomic) return ndx_writer_flush(writer);
+    return writer->error;
+}
+
+/*
+ * Finishes the compressed stream, closes the output file and deallocates the writer.
+ * If `abort` is non-zero, the data which have not been written yet are discarded, a temporary replacement file is removed
+ * instead of replacing the output file and an output file created by this writer is removed, unless other processes
+ * have appended to it in the meantime.
+ * Returns zero, if all the data have been successfully written. Else returns non-zero.
+ */
+static int ndx_writer_close(ndx_writer_t *writer, const int abort)
+{
+    if (writer == NULL) return 0;
+    if (abort) {
+        ndx_writer_free_chunks(writer);
+        writer->used = 0;
     }
+    int error = ndx_writer_flush(writer);
 
-    // write out the lipids_leaflets ndx groups
-    size_t allocated_upper = 64;
-    size_t allocated_lower = 64;
-    atom_selection_t *upper = selection_create(allocated_upper);
-    atom_selection_t *lower = selection_create(allocated_lower);
-    for (size_t i = 0; i < n_groups; ++i) {
+    if (writer->gz != NULL && gzclose(writer->gz) != Z_OK) error = 1;
+#ifdef LEAFLETS2NDX_ZSTD
+    if (writer->zstd != NULL) {
+        if (!error && ndx_writer_compress(writer, 1) != 0) error = 1;
+        ZSTD_freeCStream(writer->zstd);
+        free(writer->compressed);
+    }
+#endif
 
-        if (!empty && lipids_leaflets[i]->n_atoms == 0) continue;
+    // a created file contains only the output of this writer if its size matches the amount of data written;
+    // compressed output is not written atomically, so compressed files are never shared
+    int own_file = 0;
+    if (abort && writer->created) {
+        struct stat info;
+        own_file = is_compressed(writer->path) || (fstat(writer->fd, &info) == 0 && (size_t) info.st_size == writer->written);
+    }
+    if (writer->owns_fd && close(writer->fd) != 0) error = 1;
 
-        char group_name[100] = "";
-        char *resname = list_get(residue_names, i / 2);
-        if (resname == NULL) {
-            fprintf(stderr, "Internal error. Reaching element of index %ld in a list_t of length %ld", i / 2, residue_names->n_items);
-            fprintf(stderr, "This should never happen.\n");
-            return_code = 1;
-            free(upper);
-            free(lower);
-            goto main_end;
+    if (writer->temporary != NULL) {
+        if (abort || error || rename(writer->temporary, writer->path) != 0) {
+            unlink(writer->temporary);
+            error = 1;
         }
+        free(writer->temporary);
+    }
+    if (own_file) unlink(writer->path);
 
-        strncpy(group_name, resname, 99);
-        if (i % 2 == 0) {
-            strcat(group_name, "_lower");
-            selection_add(&lower, &allocated_lower, lipids_leaflets[i]);
-        } else {
-            strcat(group_name, "_upper");
-            selection_add(&upper, &allocated_upper, lipids_leaflets[i]);
-        }
+    free(writer->chunks);
+    free(writer->buffer);
+    free(writer);
+    return error;
+}
+
+/*
+ * Flushes and deallocates the writer, finishing the compressed stream and closing the output file.
+ * A temporary replacement file replaces the output file.
+ * Standard output is never closed.
+ * Returns zero, if all the data have been successfully written. Else returns non-zero.
+ */
+int ndx_writer_destroy(ndx_writer_t *writer)
+{
+    return ndx_writer_close(writer, 0);
+}
+
+/*
+ * Deallocates the writer of a failed run, leaving the output file as it was before, as far as possible:
+ * a temporary replacement file is removed and a newly created output file is removed, if no other process wrote into it.
+ * Data appended to an existing output file by previous commits remain.
+ */
+void ndx_writer_abort(ndx_writer_t *writer)
+{
+    ndx_writer_close(writer, 1);
+}
+
+/*
+ * Makes sure that at least `length` bytes (at most NDX_WRITER_BUFFER_SIZE) can be placed into the buffer.
+ */
+static void ndx_writer_reserve(ndx_writer_t *writer, size_t length)
+{
+    if (writer->capacity - writer->used >= length) return;
 
-        write_ndx_group(output, group_name, lipids_leaflets[i]);
+    if (writer->atomic) {
+        ndx_writer_stash(writer);
+        return;
     }
 
-    if (empty || lower->n_atoms > 0) write_ndx_group(output, "Lower", lower);
-    if (empty || upper->n_atoms > 0) write_ndx_group(output, "Upper", upper);
+    if (writer->fd >= 0) {
+        ndx_writer_flush(writer);
+        return;
+    }
 
-    if (output != stdout) fclose(output);
+    size_t capacity = writer->capacity;
+    while (capacity - writer->used < length) capacity *= 2;
+    char *buffer = realloc(writer->buffer, capacity);
+    if (buffer == NULL) {
+        // drop the data; the error is reported when the writer is flushed
+        writer->error = 1;
+        writer->used = 0;
+        return;
+    }
 
-    free(upper);
-    free(lower);
-    main_end:
-    list_destroy(residue_names);
-    destroy_selections(lipids_leaflets, n_groups);
-    dict_destroy(ndx_groups);
-    free(phosphates);
-    free(membrane);
-    free(all);
-    free(system);
+    writer->buffer = buffer;
+    writer->capacity = capacity;
+}
 
-    return return_code;
-}
\ No newline at end of file
+static void ndx_writer_put(ndx_writer_t *writer, const char *data, size_t length)
+{
+    while (length > 0) {
+        ndx_writer_reserve(writer, length < NDX_WRITER_BUFFER_SIZE ? length : NDX_WRITER_BUFFER_SIZE);
+
+        size_t chunk = writer->capacity - writer->used;
+        if (chunk > length) chunk = length;
+        memcpy(writer->buffer + writer->used, data, chunk);
+        writer->used += chunk;
+        data += chunk;
+        length -= chunk;
+    }
+}
+
+/*
+ * Formats atom number the same way as `printf("%4ld ", number)`.
+ * Returns the number of characters written into `out`, which must hold at least 22 characters.
+ */
+static size_t format_atom_number(size_t number, char *out)
+{
+    char digits[20];
+    size_t n_digits = 0;
+    do {
+        digits[n_digits++] = (char) ('0' + number % 10);
+        number /= 10;
+    } while (number > 0);
+
+    size_t length = 0;
+    for (size_t i = n_digits; i < 4; ++i) out[length++] = ' ';
+    while (n_digits > 0) out[length++] = digits[--n_digits];
+    out[length++] = ' ';
+
+    return length;
+}
+
+/*
+ * Writes several selections as a single ndx group. The atoms are written in the order of the selections
+ * without creating a merged copy of the selections.
+ */
+void write_ndx_group_parts(ndx_writer_t *writer, const char *name, atom_selection_t *const *parts, const size_t n_parts)
+{
+    ndx_writer_put(writer, "[ ", 2);
+    ndx_writer_put(writer, name, strlen(name));
+    ndx_writer_put(writer, " ]\n", 3);
+
+    size_t n_atoms = 0;
+    for (size_t p = 0; p < n_parts; ++p) n_atoms += parts[p]->n_atoms;
+
+    size_t written = 0;
+    for (size_t p = 0; p < n_parts; ++p) {
+        for (size_t i = 0; i < parts[p]->n_atoms; ++i) {
+            // make sure that the whole number and a newline fit into the buffer
+            ndx_writer_reserve(writer, 24);
+
+            writer->used += format_atom_number(parts[p]->atoms[i]->gmx_atom_number, writer->buffer + writer->used);
+            ++written;
+            if (written % 15 == 0 || written == n_atoms) writer->buffer[writer->used++] = '\n';
+        }
+    }
+}
+
+void write_ndx_group(ndx_writer_t *writer, const char *name, atom_selection_t *selection)
+{
+    write_ndx_group_parts(writer, name, &selection, 1);
+}
+
+/*
+ * Parses a fixed-width integer field. Leading and trailing spaces are ignored.
+ */
+static int parse_int_field(const char *field, const size_t width)
+{
+    size_t i = 0;
+    while (i < width && field[i] == ' ') ++i;
+
+    int sign = 1;
+    if (i < width && field[i] == '-') {
+        sign = -1;
+        ++i;
+    }
+
+    int value = 0;
+    for (; i < width && field[i] >= '0' && field[i] <= '9'; ++i) value = value * 10 + (field[i] - '0');
+    return sign * value;
+}
+
+/*
+ * Parses a fixed-width decimal number. Returns zero, if successful. Else returns non-zero.
+ */
+static int parse_float_field(const char *field, const size_t width, float *value)
+{
+    static const double POWERS[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18 };
+
+    size_t i = 0;
+    while (i < width && field[i] == ' ') ++i;
+
+    int negative = 0;
+    if (i < width && (field[i] == '-' || field[i] == '+')) {
+        negative = field[i] == '-';
+        ++i;
+    }
+
+    long long mantissa = 0;
+    size_t n_digits = 0, n_decimals = 0;
+    int decimal_point = 0;
+    for (; i < width; ++i) {
+        if (field[i] >= '0' && field[i] <= '9') {
+            mantissa = mantissa * 10 + (field[i] - '0');
+            ++n_digits;
+            if (decimal_point) ++n_decimals;
+        } else if (field[i] == '.' && !decimal_point) {
+            decimal_point = 1;
+        } else {
+            break;
+        }
+    }
+
+    // anything else than trailing spaces is not a valid number
+    for (; i < width; ++i) {
+        if (field[i] != ' ') return 1;
+    }
+
+    if (n_digits == 0 || n_digits > 18) return 1;
+
+    double result = (double) mantissa / POWERS[n_decimals];
+    *value = (float) (negative ? -result : result);
+    return 0;
+}
+
+/*
+ * Copies a fixed-width name field into `name` with leading and trailing spaces removed.
+ */
+static void parse_name_field(const char *field, const size_t width, char *name, const size_t capacity)
+{
+    size_t start = 0, end = width;
+    while (start < end && field[start] == ' ') ++start;
+    while (end > start && field[end - 1] == ' ') --end;
+
+    size_t length = end - start;
+    if (length > capacity - 1) length = capacity - 1;
+    memcpy(name, field + start, length);
+    name[length] = '\0';
+}
+
+/*
+ * Returns the width of the coordinate fields used in a gro atom line (8 in standard gro files).
+ * The width is derived from the distance between the decimal points of the first two coordinates.
+ */
+static size_t gro_coordinate_width(const char *line, const size_t length)
+{
+    const char *first = length > 20 ? memchr(line + 20, '.', length - 20) : NULL;
+    if (first == NULL) return 8;
+
+    const char *second = memchr(first + 1, '.', length - (first + 1 - line));
+    if (second == NULL || second - first < 4) return 8;
+
+    return (size_t) (second - first);
+}
+
+/*
+ * Parses `n_atoms` atom lines starting at `data` into `atoms`. `first_index` is the index of the first parsed atom in the system.
+ * Returns pointer to the data following the last parsed line or NULL if the lines could not be parsed.
+ */
+const char *parse_gro_atoms(
+        const char *data,
+        const char *end,
+        const size_t n_atoms,
+        const size_t first_index,
+        const size_t width,
+        atom_t *atoms)
+{
+    for (size_t i = 0; i < n_atoms; ++i) {
+        const char *eol = memchr(data, '\n', end - data);
+        if (eol == NULL) eol = end;
+
+        size_t length = eol - data;
+        if (length > 0 && data[length - 1] == '\r') --length;
+
+        // residue number, residue name, atom name, atom number and three coordinates
+        if (length < 20 + 3 * width) return NULL;
+
+        atom_t *atom = &atoms[i];
+        atom->residue_number = parse_int_field(data, 5);
+        parse_name_field(data + 5, 5, atom->residue_name, sizeof(atom->residue_name));
+        parse_name_field(data + 10, 5, atom->atom_name, sizeof(atom->atom_name));
+        // atom numbers wrap in gro files, so they are not read
+        atom->gmx_atom_number = first_index + i + 1;
+
+        for (int dim = 0; dim < 3; ++dim) {
+            if (parse_float_field(data + 20 + dim * width, width, &atom->position[dim]) != 0) return NULL;
+        }
+
+        // velocities are optional and use the same field width as coordinates
+        if (length >= 20 + 6 * width) {
+            for (int dim = 0; dim < 3; ++dim) {
+                if (parse_float_field(data + 20 + (3 + dim) * width, width, &atom->velocity[dim]) != 0) return NULL;
+            }
+        } else {
+            memset(atom->velocity, 0, sizeof(vec_t));
+        }
+
+        data = eol < end ? eol + 1 : end;
+    }
+
+    return data;
+}
+
+/*
+ * Part of the atom section of a gro file parsed by a single thread.
+ */
+typedef struct gro_chunk {
+    const char *start;
+    const char *end;
+    size_t n_atoms;
+    size_t first_index;
+    size_t width;
+    atom_t *atoms;
+    const char *parsed_end;
+} gro_chunk_t;
+
+static void *parse_gro_chunk(void *arg)
+{
+    gro_chunk_t *chunk = arg;
+    chunk->parsed_end = parse_gro_atoms(chunk->start, chunk->end, chunk->n_atoms, chunk->first_index, chunk->width, &chunk->atoms[chunk->first_index]);
+    return NULL;
+}
+
+// minimal number of atoms parsed by a single thread
+#define GRO_CHUNK_MIN_ATOMS 65536
+
+/*
+ * Parses the atom section of a gro file using multiple threads.
+ * Gro atom lines usually have the same length, so the offset of each thread's chunk is calculated from the length of the first line.
+ * Returns pointer to the data following the atom section or NULL if the lines do not have a constant length or could not be parsed.
+ * In that case, the atoms should be parsed sequentially.
+ */
+const char *parse_gro_atoms_parallel(
+        const char *data,
+        const char *end,
+        const size_t n_atoms,
+        const size_t width,
+        atom_t *atoms,
+        size_t n_threads)
+{
+    if (n_threads > n_atoms / GRO_CHUNK_MIN_ATOMS) n_threads = n_atoms / GRO_CHUNK_MIN_ATOMS;
+    if (n_threads < 2) return NULL;
+
+    const char *eol = memchr(data, '\n', end - data);
+    if (eol == NULL) return NULL;
+    size_t line_length = eol - data + 1;
+    if ((size_t) (end - data) < n_atoms * line_length) return NULL;
+
+    gro_chunk_t *chunks = calloc(n_threads, sizeof(gro_chunk_t));
+    pthread_t *threads = calloc(n_threads, sizeof(pthread_t));
+    if (chunks == NULL || threads == NULL) {
+        free(chunks);
+        free(threads);
+        return NULL;
+    }
+
+    size_t per_thread = n_atoms / n_threads;
+    for (size_t i = 0; i < n_threads; ++i) {
+        chunks[i].first_index = i * per_thread;
+        chunks[i].n_atoms = i + 1 == n_threads ? n_atoms - chunks[i].first_index : per_thread;
+        chunks[i].start = data + chunks[i].first_index * line_length;
+        chunks[i].end = end;
+        chunks[i].width = width;
+        chunks[i].atoms = atoms;
+    }
+
+    // the calling thread parses the first chunk
+    size_t n_started = 1;
+    for (; n_started < n_threads; ++n_started) {
+        if (pthread_create(&threads[n_started], NULL, parse_gro_chunk, &chunks[n_started]) != 0) break;
+    }
+    parse_gro_chunk(&chunks[0]);
+    for (size_t i = 1; i < n_started; ++i) pthread_join(threads[i], NULL);
+
+    // each chunk must end exactly where the next one starts, otherwise the lines are not of constant length
+    const char *parsed_end = NULL;
+    if (n_started == n_threads) {
+        parsed_end = chunks[n_threads - 1].parsed_end;
+        for (size_t i = 0; i + 1 < n_threads; ++i) {
+            if (chunks[i].parsed_end != chunks[i + 1].start) parsed_end = NULL;
+        }
+    }
+
+    free(chunks);
+    free(threads);
+    return parsed_end;
+}
+
+/*
+ * Returns pointer to the start of the next line or `end` if there is no next line.
+ */
+static const char *next_line(const char *data, const char *end)
+{
+    const char *eol = memchr(data, '\n', end - data);
+    return eol == NULL ? end : eol + 1;
+}
+
+/*
+ * Parses the box line of a gro file: 3 values for rectangular boxes, 9 values for triclinic boxes.
+ * Returns zero, if successful. Else returns non-zero.
+ */
+static int parse_gro_box(const char *line, size_t length, system_t *system)
+{
+    const size_t box_size = sizeof(box_t) / sizeof(system->box[0]);
+    char box_line[256] = "";
+    if (length > sizeof(box_line) - 1) length = sizeof(box_line) - 1;
+    memcpy(box_line, line, length);
+
+    char *pointer = box_line;
+    for (size_t i = 0; i < box_size && i < 9; ++i) {
+        char *next = NULL;
+        float value = strtof(pointer, &next);
+        if (next == pointer) return i < 3;
+        system->box[i] = value;
+        pointer = next;
+    }
+
+    return 0;
+}
+
+/*
+ * Parses gro file stored in memory. Atoms of large systems are parsed using up to `n_threads` threads.
+ * Returns pointer to the system or NULL if the data could not be parsed.
+ */
+system_t *parse_gro(const char *data, const size_t size, const char *filename, const size_t n_threads)
+{
+    const char *end = data + size;
+
+    // skip title
+    const char *line = next_line(data, end);
+    if (line == end) {
+        fprintf(stderr, "File %s is not a valid gro file.\n", filename);
+        return NULL;
+    }
+
+    // the data are not terminated, so the count is parsed from a bounded copy of its line
+    const char *count_eol = memchr(line, '\n', end - line);
+    size_t count_length = (size_t) ((count_eol == NULL ? end : count_eol) - line);
+    char count_line[32] = "";
+    memcpy(count_line, line, count_length < sizeof(count_line) - 1 ? count_length : sizeof(count_line) - 1);
+    char *count_end = NULL;
+    long n_atoms = strtol(count_line, &count_end, 10);
+    if (count_end == count_line || n_atoms < 0 || (unsigned long) n_atoms > (SIZE_MAX - sizeof(system_t)) / sizeof(atom_t)) {
+        fprintf(stderr, "Could not read the number of atoms from file %s.\n", filename);
+        return NULL;
+    }
+    line = next_line(line, end);
+
+    system_t *system = calloc(1, sizeof(system_t) + n_atoms * sizeof(atom_t));
+    if (system == NULL) {
+        fprintf(stderr, "Could not allocate memory for system from file %s.\n", filename);
+        return NULL;
+    }
+    system->n_atoms = (size_t) n_atoms;
+
+    const char *first_eol = memchr(line, '\n', end - line);
+    size_t width = gro_coordinate_width(line, (first_eol == NULL ? end : first_eol) - line);
+
+    const char *atoms_end = parse_gro_atoms_parallel(line, end, system->n_atoms, width, system->atoms, n_threads);
+    line = atoms_end != NULL ? atoms_end : parse_gro_atoms(line, end, system->n_atoms, 0, width, system->atoms);
+    if (line == NULL) {
+        fprintf(stderr, "Could not parse atoms from file %s.\n", filename);
+        free(system);
+        return NULL;
+    }
+
+    if (parse_gro_box(line, (size_t) (next_line(line, end) - line), system) != 0) {
+        fprintf(stderr, "Could not read box from file %s.\n", filename);
+        free(system);
+        return NULL;
+    }
+
+    return system;
+}
+
+/*
+ * Reads gro file by mapping it into memory and parsing it using up to `n_threads` threads.
+ * Falls back to groan's load_gro if the file cannot be mapped.
+ * Returns pointer to the system or NULL if the file could not be read.
+ */
+system_t *mmap_gro(const char *filename, const size_t n_threads)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "File %s could not be read.\n", filename);
+        return NULL;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode) || info.st_size == 0) {
+        close(fd);
+        return load_gro(filename);
+    }
+
+    void *data = mmap(NULL, (size_t) info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return load_gro(filename);
+
+    posix_madvise(data, (size_t) info.st_size, POSIX_MADV_SEQUENTIAL);
+    system_t *system = parse_gro(data, (size_t) info.st_size, filename, n_threads);
+
+    munmap(data, (size_t) info.st_size);
+    return system;
+}
+
+/*
+ * Sequential reader of a possibly compressed input file or standard input ('-').
+ * Plain and gzip-compressed files are read through zlib, which passes uncompressed data through unchanged.
+ * Files ending with .zst are decompressed using zstd, if compiled with zstd support.
+ */
+typedef struct input_stream {
+    gzFile gz;
+#ifdef LEAFLETS2NDX_ZSTD
+    int fd;
+    ZSTD_DStream *zstd;
+    char *compressed;       // input buffer of the zstd decompressor
+    ZSTD_inBuffer input;
+    size_t pending;         // non-zero if the last zstd frame is not complete
+#endif
+} input_stream_t;
+
+/*
+ * Opens the file for sequential reading.
+ * Returns pointer to the stream or NULL if the file could not be opened.
+ */
+input_stream_t *input_stream_open(const char *filename)
+{
+    input_stream_t *stream = calloc(1, sizeof(input_stream_t));
+    if (stream == NULL) return NULL;
+
+    if (ends_with(filename, ".zst")) {
+#ifdef LEAFLETS2NDX_ZSTD
+        stream->fd = open(filename, O_RDONLY);
+        stream->zstd = ZSTD_createDStream();
+        stream->compressed = malloc(ZSTD_DStreamInSize());
+        if (stream->fd < 0 || stream->zstd == NULL || stream->compressed == NULL || ZSTD_isError(ZSTD_initDStream(stream->zstd))) {
+            if (stream->fd >= 0) close(stream->fd);
+            ZSTD_freeDStream(stream->zstd);
+            free(stream->compressed);
+            free(stream);
+            return NULL;
+        }
+        stream->input.src = stream->compressed;
+        return stream;
+#else
+        fprintf(stderr, "Reading zstd-compressed file %s requires leaflets2ndx compiled with zstd support.\n", filename);
+        free(stream);
+        return NULL;
+#endif
+    }
+
+    if (strcmp(filename, "-") == 0) {
+        // zlib closes the descriptor, so standard input itself is kept open
+        int fd = dup(STDIN_FILENO);
+        stream->gz = fd < 0 ? NULL : gzdopen(fd, "rb");
+        if (stream->gz == NULL && fd >= 0) close(fd);
+    } else {
+        stream->gz = gzopen(filename, "rb");
+    }
+
+    if (stream->gz == NULL) {
+        free(stream);
+        return NULL;
+    }
+    gzbuffer(stream->gz, 1 << 18);
+
+    return stream;
+}
+
+/*
+ * Reads up to `size` decompressed bytes into `buffer`.
+ * Returns the number of bytes read, 0 at the end of the file or -1 if the file could not be read or decompressed.
+ */
+ssize_t input_stream_read(input_stream_t *stream, char *buffer, const size_t size)
+{
+#ifdef LEAFLETS2NDX_ZSTD
+    if (stream->zstd != NULL) {
+        ZSTD_outBuffer output = { buffer, size, 0 };
+        while (output.pos == 0) {
+            if (stream->input.pos == stream->input.size) {
+                ssize_t n = read(stream->fd, stream->compressed, ZSTD_DStreamInSize());
+                if (n < 0 && errno == EINTR) continue;
+                if (n < 0) return -1;
+                // end of file in the middle of a frame means that the file is truncated
+                if (n == 0) return stream->pending != 0 ? -1 : 0;
+                stream->input.size = (size_t) n;
+                stream->input.pos = 0;
+            }
+
+            stream->pending = ZSTD_decompressStream(stream->zstd, &output, &stream->input);
+            if (ZSTD_isError(stream->pending)) return -1;
+        }
+
+        return (ssize_t) output.pos;
+    }
+#endif
+
+    int n = gzread(stream->gz, buffer, size > INT_MAX ? INT_MAX : (unsigned) size);
+    int error = Z_OK;
+    // zlib reports a truncated gzip file only through gzerror
+    if (n == 0) gzerror(stream->gz, &error);
+    return n < 0 || error != Z_OK ? -1 : n;
+}
+
+void input_stream_close(input_stream_t *stream)
+{
+    if (stream == NULL) return;
+#ifdef LEAFLETS2NDX_ZSTD
+    if (stream->zstd != NULL) {
+        close(stream->fd);
+        ZSTD_freeDStream(stream->zstd);
+        free(stream->compressed);
+    }
+#endif
+    if (stream->gz != NULL) gzclose(stream->gz);
+    free(stream);
+}
+
+/*
+ * Reads the whole (decompressed) content of a file into memory.
+ * Returns pointer to the content and its size in `size` or NULL if the file could not be read.
+ */
+char *input_stream_read_all(const char *filename, size_t *size)
+{
+    input_stream_t *stream = input_stream_open(filename);
+    if (stream == NULL) return NULL;
+
+    size_t capacity = 1 << 20;
+    char *data = malloc(capacity);
+    *size = 0;
+
+    ssize_t n = 0;
+    while (data != NULL && (n = input_stream_read(stream, data + *size, capacity - *size)) > 0) {
+        *size += (size_t) n;
+        if (*size == capacity) {
+            char *larger = realloc(data, capacity *= 2);
+            if (larger == NULL) free(data);
+            data = larger;
+        }
+    }
+
+    input_stream_close(stream);
+    if (n < 0) {
+        free(data);
+        return NULL;
+    }
+
+    return data;
+}
+
+/*
+ * Splits a stream into lines using a buffer which only grows if a single line does not fit into it.
+ */
+typedef struct line_reader {
+    input_stream_t *stream;
+    char *buffer;
+    size_t capacity;
+    size_t start;
+    size_t end;
+    int eof;
+    int error;
+} line_reader_t;
+
+/*
+ * Returns pointer to the next line and its length without the newline in `length` or NULL if there is no further line.
+ * The line is only valid until the next call.
+ */
+static const char *line_reader_next(line_reader_t *reader, size_t *length)
+{
+    while (1) {
+        const char *line = reader->buffer + reader->start;
+        const char *eol = memchr(line, '\n', reader->end - reader->start);
+        if (eol != NULL) {
+            *length = (size_t) (eol - line);
+            reader->start += *length + 1;
+            return line;
+        }
+
+        if (reader->eof) {
+            if (reader->start == reader->end) return NULL;
+            *length = reader->end - reader->start;
+            reader->start = reader->end;
+            return line;
+        }
+
+        // move the incomplete line to the start of the buffer and read more data
+        memmove(reader->buffer, line, reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->start = 0;
+
+        if (reader->end == reader->capacity) {
+            char *buffer = realloc(reader->buffer, reader->capacity * 2);
+            if (buffer == NULL) {
+                reader->error = 1;
+                return NULL;
+            }
+            reader->buffer = buffer;
+            reader->capacity *= 2;
+        }
+
+        ssize_t n = input_stream_read(reader->stream, reader->buffer + reader->end, reader->capacity - reader->end);
+        if (n <= 0) {
+            reader->eof = 1;
+            reader->error = n < 0;
+        } else {
+            reader->end += (size_t) n;
+        }
+    }
+}
+
+/*
+ * Reads gro file line by line through a streaming decompressor in a single pass. Only the parsed atoms
+ * and a small line buffer are kept in memory, so the file can also be a pipe or standard input ('-').
+ * Returns pointer to the system or NULL if the file could not be read.
+ */
+system_t *stream_gro(const char *filename)
+{
+    const char *name = strcmp(filename, "-") == 0 ? "(standard input)" : filename;
+    input_stream_t *stream = input_stream_open(filename);
+    if (stream == NULL) {
+        fprintf(stderr, "File %s could not be read.\n", name);
+        return NULL;
+    }
+
+    line_reader_t reader = { stream, malloc(1 << 20), 1 << 20, 0, 0, 0, 0 };
+    system_t *system = NULL;
+    if (reader.buffer == NULL) {
+        fprintf(stderr, "Could not allocate memory for reading file %s.\n", name);
+        goto stream_end;
+    }
+
+    // skip title
+    size_t length = 0;
+    const char *line = line_reader_next(&reader, &length);
+    const char *count = line == NULL ? NULL : line_reader_next(&reader, &length);
+    if (count == NULL) {
+        if (reader.error) fprintf(stderr, "Could not decompress file %s.\n", name);
+        else fprintf(stderr, "File %s is not a valid gro file.\n", name);
+        goto stream_end;
+    }
+
+    char count_line[32] = "";
+    memcpy(count_line, count, length < sizeof(count_line) - 1 ? length : sizeof(count_line) - 1);
+    char *count_end = NULL;
+    long n_atoms = strtol(count_line, &count_end, 10);
+    if (count_end == count_line || n_atoms < 0 || (unsigned long) n_atoms > (SIZE_MAX - sizeof(system_t)) / sizeof(atom_t)) {
+        fprintf(stderr, "Could not read the number of atoms from file %s.\n", name);
+        goto stream_end;
+    }
+
+    system = calloc(1, sizeof(system_t) + n_atoms * sizeof(atom_t));
+    if (system == NULL) {
+        fprintf(stderr, "Could not allocate memory for system from file %s.\n", name);
+        goto stream_end;
+    }
+    system->n_atoms = (size_t) n_atoms;
+
+    size_t width = 8;
+    for (size_t i = 0; i < system->n_atoms; ++i) {
+        line = line_reader_next(&reader, &length);
+        if (i == 0 && line != NULL) width = gro_coordinate_width(line, length);
+
+        if (line == NULL || parse_gro_atoms(line, line + length, 1, i, width, &system->atoms[i]) == NULL) {
+            if (reader.error) fprintf(stderr, "Could not decompress file %s.\n", name);
+            else fprintf(stderr, "Could not parse atoms from file %s.\n", name);
+            free(system);
+            system = NULL;
+            goto stream_end;
+        }
+    }
+
+    line = line_reader_next(&reader, &length);
+    if (line == NULL || parse_gro_box(line, length, system) != 0) {
+        fprintf(stderr, "Could not read box from file %s.\n", name);
+        free(system);
+        system = NULL;
+    }
+
+    stream_end:
+    free(reader.buffer);
+    input_stream_close(stream);
+    return system;
+}
+
+/*
+ * Reads gro file. Regular files are mapped into memory. Compressed files, standard input ('-') and other
+ * files that cannot be mapped, such as pipes, are read in a single streaming pass.
+ * Returns pointer to the system or NULL if the file could not be read.
+ */
+system_t *read_gro(const char *filename, const size_t n_threads)
+{
+    struct stat info;
+    if (strcmp(filename, "-") == 0 || is_compressed(filename) ||
+            (stat(filename, &info) == 0 && !S_ISREG(info.st_mode))) return stream_gro(filename);
+    return mmap_gro(filename, n_threads);
+}
+
+/*
+ * Finds the next ndx group header in data. Stores the group name and the range of the group content.
+ * Returns pointer to the header or NULL if there is no further group.
+ */
+static const char *next_ndx_group(
+        const char *data,
+        const char *end,
+        const char **name,
+        size_t *name_length,
+        const char **content,
+        const char **content_end)
+{
+    const char *header = data < end ? memchr(data, '[', end - data) : NULL;
+    while (header != NULL) {
+        const char *close_bracket = memchr(header, ']', end - header);
+        const char *eol = memchr(header, '\n', end - header);
+        if (close_bracket != NULL && (eol == NULL || close_bracket < eol)) {
+            // like groan's read_ndx, only the first word inside the brackets is the name of the group
+            *name = header + 1;
+            while (*name < close_bracket && (**name == ' ' || **name == '\t')) ++(*name);
+            const char *name_end = *name;
+            while (name_end < close_bracket && *name_end != ' ' && *name_end != '\t') ++name_end;
+            *name_length = (size_t) (name_end - *name);
+
+            *content = eol == NULL ? end : eol + 1;
+            const char *next = *content < end ? memchr(*content, '[', end - *content) : NULL;
+            *content_end = next == NULL ? end : next;
+            return header;
+        }
+
+        header = eol == NULL ? NULL : memchr(eol, '[', end - eol);
+    }
+
+    return NULL;
+}
+
+/*
+ * Checks whether `name` appears as a standalone word in any of the selection queries.
+ */
+static int query_references(const char *name, const size_t length, const char **queries, const size_t n_queries)
+{
+    for (size_t i = 0; i < n_queries; ++i) {
+        const char *query = queries[i];
+        for (const char *found = strstr(query, name); found != NULL; found = strstr(found + 1, name)) {
+            // the name must be delimited by the start or end of the query, whitespace or operators
+            char before = found == query ? ' ' : found[-1];
+            char after = found[length];
+            if (strchr(" \t()!&|", before) != NULL && (after == '\0' || strchr(" \t()!&|", after) != NULL)) return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Parses atom numbers of a single ndx group into a selection.
+ * Returns pointer to the selection or NULL if the group contains an invalid atom number.
+ */
+atom_selection_t *parse_ndx_group(const char *data, const char *end, system_t *system)
+{
+    size_t allocated = 64;
+    atom_selection_t *selection = selection_create(allocated);
+    if (selection == NULL) return NULL;
+
+    while (data < end) {
+        if (*data < '0' || *data > '9') {
+            ++data;
+            continue;
+        }
+
+        size_t number = 0;
+        for (; data < end && *data >= '0' && *data <= '9'; ++data) number = number * 10 + (size_t) (*data - '0');
+
+        if (number == 0 || number > system->n_atoms) {
+            free(selection);
+            return NULL;
+        }
+
+        selection_add_atom(&selection, &allocated, &system->atoms[number - 1]);
+    }
+
+    return selection;
+}
+
+/*
+ * Parses ndx groups referenced in the selection queries from ndx file content stored in memory.
+ * Returns a dictionary of the parsed ndx groups or NULL if memory could not be allocated.
+ */
+dict_t *select_ndx_groups(const char *data, const size_t size, system_t *system, const char **queries, const size_t n_queries, const char *filename)
+{
+    dict_t *groups = dict_create();
+    if (groups == NULL) return NULL;
+
+    const char *end = data + size;
+    const char *name = NULL, *content = NULL, *content_end = NULL;
+    size_t length = 0;
+    for (const char *header = next_ndx_group(data, end, &name, &length, &content, &content_end);
+            header != NULL;
+            header = next_ndx_group(content_end, end, &name, &length, &content, &content_end)) {
+
+        char group_name[256] = "";
+        if (length == 0 || length >= sizeof(group_name)) continue;
+        memcpy(group_name, name, length);
+        if (!query_references(group_name, length, queries, n_queries)) continue;
+
+        atom_selection_t *selection = parse_ndx_group(content, content_end, system);
+        if (selection == NULL) {
+            fprintf(stderr, "Could not read ndx group '%s' from file %s.\n", group_name, filename);
+            continue;
+        }
+
+        dict_set(groups, group_name, selection, sizeof(atom_selection_t) + selection->n_atoms * sizeof(atom_t *));
+        free(selection);
+    }
+
+    return groups;
+}
+
+/*
+ * Reads ndx file lazily. Only the group headers are scanned and only groups referenced in the selection queries are parsed.
+ * Compressed ndx files are decompressed into memory first.
+ * Returns a dictionary of the parsed ndx groups or NULL if the file could not be read.
+ */
+dict_t *read_ndx_lazy(const char *filename, system_t *system, const char **queries, const size_t n_queries)
+{
+    if (is_compressed(filename)) {
+        size_t size = 0;
+        char *data = input_stream_read_all(filename, &size);
+        if (data == NULL) return NULL;
+
+        dict_t *groups = select_ndx_groups(data, size, system, queries, n_queries, filename);
+        free(data);
+        return groups;
+    }
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode)) {
+        close(fd);
+        return read_ndx(filename, system);
+    }
+
+    if (info.st_size == 0) {
+        close(fd);
+        return dict_create();
+    }
+
+    size_t size = (size_t) info.st_size;
+    char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return read_ndx(filename, system);
+
+    dict_t *groups = select_ndx_groups(data, size, system, queries, n_queries, filename);
+    munmap(data, size);
+    return groups;
+}
+
+/*
+ * Binary sidecar of an ndx file containing pre-parsed ndx groups.
+ * Layout: header, table of groups, group names, atom numbers (uint32_t).
+ * The sidecar is valid only for an ndx file of the same size and modification time.
+ */
+#define NDX_CACHE_MAGIC "L2NDXIDX"
+#define NDX_CACHE_VERSION 2
+
+typedef struct ndx_cache_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t n_groups;
+    uint64_t ndx_size;
+    int64_t ndx_mtime_sec;
+    int64_t ndx_mtime_nsec;
+} ndx_cache_header_t;
+
+typedef struct ndx_cache_group {
+    uint64_t name_offset;
+    uint64_t name_length;
+    uint64_t atoms_offset;
+    uint64_t n_atoms;
+} ndx_cache_group_t;
+
+/*
+ * Builds the sidecar of an ndx file in memory.
+ * Returns pointer to the sidecar data and its size in `size` or NULL if the ndx file could not be parsed.
+ */
+char *ndx_cache_build(const char *data, const size_t data_size, const struct stat *info, size_t *size)
+{
+    const char *end = data + data_size;
+    const char *name = NULL, *content = NULL, *content_end = NULL;
+    size_t name_length = 0;
+
+    // first pass: count groups, lengths of names and atom numbers
+    size_t n_groups = 0, names_size = 0, n_numbers = 0;
+    for (const char *header = next_ndx_group(data, end, &name, &name_length, &content, &content_end);
+            header != NULL;
+            header = next_ndx_group(content_end, end, &name, &name_length, &content, &content_end)) {
+        ++n_groups;
+        names_size += name_length + 1;
+        for (const char *c = content; c < content_end; ++c) {
+            if (*c >= '0' && *c <= '9' && (c == content || c[-1] < '0' || c[-1] > '9')) ++n_numbers;
+        }
+    }
+
+    size_t atoms_start = sizeof(ndx_cache_header_t) + n_groups * sizeof(ndx_cache_group_t) + names_size;
+    atoms_start = (atoms_start + 7) & ~(size_t) 7;
+    *size = atoms_start + n_numbers * sizeof(uint32_t);
+
+    char *cache = calloc(1, *size);
+    if (cache == NULL) return NULL;
+
+    ndx_cache_header_t *header = (ndx_cache_header_t *) cache;
+    memcpy(header->magic, NDX_CACHE_MAGIC, 8);
+    header->version = NDX_CACHE_VERSION;
+    header->n_groups = (uint32_t) n_groups;
+    header->ndx_size = (uint64_t) info->st_size;
+    header->ndx_mtime_sec = (int64_t) info->st_mtim.tv_sec;
+    header->ndx_mtime_nsec = (int64_t) info->st_mtim.tv_nsec;
+
+    // second pass: fill the groups
+    ndx_cache_group_t *groups = (ndx_cache_group_t *) (cache + sizeof(ndx_cache_header_t));
+    size_t name_offset = sizeof(ndx_cache_header_t) + n_groups * sizeof(ndx_cache_group_t);
+    uint32_t *atoms = (uint32_t *) (cache + atoms_start);
+    size_t n_written = 0;
+
+    size_t group = 0;
+    for (const char *header = next_ndx_group(data, end, &name, &name_length, &content, &content_end);
+            header != NULL;
+            header = next_ndx_group(content_end, end, &name, &name_length, &content, &content_end), ++group) {
+        groups[group].name_offset = name_offset;
+        groups[group].name_length = name_length;
+        memcpy(cache + name_offset, name, name_length);
+        name_offset += name_length + 1;
+
+        groups[group].atoms_offset = atoms_start + n_written * sizeof(uint32_t);
+        for (const char *c = content; c < content_end;) {
+            if (*c < '0' || *c > '9') {
+                ++c;
+                continue;
+            }
+
+            uint64_t number = 0;
+            for (; c < content_end && *c >= '0' && *c <= '9'; ++c) number = number * 10 + (uint64_t) (*c - '0');
+            if (number > UINT32_MAX) {
+                free(cache);
+                return NULL;
+            }
+
+            atoms[n_written++] = (uint32_t) number;
+        }
+        groups[group].n_atoms = n_written - (groups[group].atoms_offset - atoms_start) / sizeof(uint32_t);
+    }
+
+    return cache;
+}
+
+/*
+ * Checks that the sidecar is consistent and belongs to the ndx file described by `info`.
+ * Returns zero, if the sidecar is valid. Else returns non-zero.
+ */
+int ndx_cache_validate(const char *cache, const size_t size, const struct stat *info)
+{
+    if (size < sizeof(ndx_cache_header_t)) return 1;
+
+    const ndx_cache_header_t *header = (const ndx_cache_header_t *) cache;
+    if (memcmp(header->magic, NDX_CACHE_MAGIC, 8) != 0 || header->version != NDX_CACHE_VERSION) return 1;
+    if (header->ndx_size != (uint64_t) info->st_size ||
+            header->ndx_mtime_sec != (int64_t) info->st_mtim.tv_sec ||
+            header->ndx_mtime_nsec != (int64_t) info->st_mtim.tv_nsec) return 1;
+
+    if (header->n_groups > (size - sizeof(ndx_cache_header_t)) / sizeof(ndx_cache_group_t)) return 1;
+
+    // offsets are checked before they are used in any arithmetic, so that corrupted values can not wrap around
+    const ndx_cache_group_t *groups = (const ndx_cache_group_t *) (cache + sizeof(ndx_cache_header_t));
+    for (size_t i = 0; i < header->n_groups; ++i) {
+        if (groups[i].name_offset >= size || groups[i].name_length > size - groups[i].name_offset - 1) return 1;
+        // names are used as C strings
+        if (cache[groups[i].name_offset + groups[i].name_length] != '\0') return 1;
+
+        if (groups[i].atoms_offset > size || groups[i].atoms_offset % sizeof(uint32_t) != 0) return 1;
+        if (groups[i].n_atoms > (size - groups[i].atoms_offset) / sizeof(uint32_t)) return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Creates ndx groups referenced in the selection queries from a valid sidecar.
+ * Returns a dictionary of the ndx groups or NULL if memory could not be allocated.
+ */
+dict_t *ndx_cache_select(const char *cache, system_t *system, const char **queries, const size_t n_queries, const char *filename)
+{
+    dict_t *dict = dict_create();
+    if (dict == NULL) return NULL;
+
+    const ndx_cache_header_t *header = (const ndx_cache_header_t *) cache;
+    const ndx_cache_group_t *groups = (const ndx_cache_group_t *) (cache + sizeof(ndx_cache_header_t));
+    for (size_t i = 0; i < header->n_groups; ++i) {
+        const char *name = cache + groups[i].name_offset;
+        if (groups[i].name_length == 0 || !query_references(name, groups[i].name_length, queries, n_queries)) continue;
+
+        atom_selection_t *selection = selection_create(groups[i].n_atoms);
+        if (selection == NULL) {
+            dict_destroy(dict);
+            return NULL;
+        }
+
+        const uint32_t *numbers = (const uint32_t *) (cache + groups[i].atoms_offset);
+        for (size_t j = 0; j < groups[i].n_atoms; ++j) {
+            if (numbers[j] == 0 || numbers[j] > system->n_atoms) {
+                fprintf(stderr, "Could not read ndx group '%s' from file %s.\n", name, filename);
+                free(selection);
+                selection = NULL;
+                break;
+            }
+            selection->atoms[j] = &system->atoms[numbers[j] - 1];
+        }
+
+        if (selection == NULL) continue;
+        selection->n_atoms = groups[i].n_atoms;
+        dict_set(dict, name, selection, sizeof(atom_selection_t) + selection->n_atoms * sizeof(atom_t *));
+        free(selection);
+    }
+
+    return dict;
+}
+
+/*
+ * Writes data into a temporary file which is then atomically renamed to `path`.
+ * Returns zero, if successful. Else returns non-zero.
+ */
+int write_file_atomically(const char *path, const char *data, const size_t size)
+{
+    char temporary[4096] = "";
+    if ((size_t) snprintf(temporary, sizeof(temporary), "%s.XXXXXX", path) >= sizeof(temporary)) return 1;
+
+    int fd = mkstemp(temporary);
+    if (fd < 0) return 1;
+    fchmod(fd, 0644);
+
+    int error = write_all(fd, data, size);
+    if (close(fd) != 0 || error || rename(temporary, path) != 0) {
+        unlink(temporary);
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Reads ndx groups referenced in the selection queries using a binary sidecar `<ndx file>.idx`.
+ * If the sidecar is missing or outdated, the ndx file is parsed and the sidecar is (re)created.
+ * Returns a dictionary of the ndx groups or NULL if the ndx file could not be read.
+ */
+dict_t *read_ndx_cached(const char *filename, system_t *system, const char **queries, const size_t n_queries)
+{
+    struct stat info;
+    if (stat(filename, &info) != 0 || !S_ISREG(info.st_mode)) return read_ndx_lazy(filename, system, queries, n_queries);
+
+    char cache_path[4096] = "";
+    if ((size_t) snprintf(cache_path, sizeof(cache_path), "%s.idx", filename) >= sizeof(cache_path)) {
+        return read_ndx_lazy(filename, system, queries, n_queries);
+    }
+
+    // try the existing sidecar first
+    int fd = open(cache_path, O_RDONLY);
+    if (fd >= 0) {
+        struct stat cache_info;
+        if (fstat(fd, &cache_info) == 0 && cache_info.st_size > 0) {
+            size_t size = (size_t) cache_info.st_size;
+            char *cache = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (cache != MAP_FAILED) {
+                dict_t *dict = NULL;
+                if (ndx_cache_validate(cache, size, &info) == 0) dict = ndx_cache_select(cache, system, queries, n_queries, filename);
+                munmap(cache, size);
+                if (dict != NULL) {
+                    close(fd);
+                    return dict;
+                }
+            }
+        }
+        close(fd);
+    }
+
+    // parse the ndx file and create the sidecar; compressed files are decompressed into memory
+    char *data = NULL;
+    size_t data_size = 0;
+    if (is_compressed(filename)) {
+        data = input_stream_read_all(filename, &data_size);
+        if (data == NULL) return NULL;
+    } else {
+        fd = open(filename, O_RDONLY);
+        if (fd < 0) return NULL;
+
+        if (info.st_size == 0) {
+            close(fd);
+            return dict_create();
+        }
+
+        data_size = (size_t) info.st_size;
+        data = mmap(NULL, data_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) return read_ndx_lazy(filename, system, queries, n_queries);
+    }
+
+    size_t size = 0;
+    char *cache = ndx_cache_build(data, data_size, &info, &size);
+    if (is_compressed(filename)) free(data);
+    else munmap(data, data_size);
+    if (cache == NULL) return read_ndx_lazy(filename, system, queries, n_queries);
+
+    if (write_file_atomically(cache_path, cache, size) != 0) {
+        fprintf(stderr, "Warning. Could not write ndx sidecar %s.\n", cache_path);
+    }
+
+    dict_t *dict = ndx_cache_select(cache, system, queries, n_queries, filename);
+    free(cache);
+    return dict;
+}
+
+/*
+ * Contiguous range of atoms of a selection belonging to the same residue.
+ */
+typedef struct residue_span {
+    size_t start;
+    size_t length;
+} residue_span_t;
+
+/*
+ * Splits atoms of a selection into residues without copying the atoms.
+ * A new residue starts whenever the residue number changes between consecutive atoms.
+ * Returns the number of residues and stores the spans in `spans` or returns 0 if the splitting failed.
+ */
+size_t split_residues(const atom_selection_t *selection, residue_span_t **spans)
+{
+    *spans = NULL;
+    if (selection->n_atoms == 0) return 0;
+
+    // count the residues first so that a single allocation suffices
+    size_t n_residues = 1;
+    for (size_t i = 1; i < selection->n_atoms; ++i) {
+        if (selection->atoms[i]->residue_number != selection->atoms[i - 1]->residue_number) ++n_residues;
+    }
+
+    *spans = malloc(n_residues * sizeof(residue_span_t));
+    if (*spans == NULL) return 0;
+
+    size_t current = 0;
+    (*spans)[0].start = 0;
+    for (size_t i = 1; i < selection->n_atoms; ++i) {
+        if (selection->atoms[i]->residue_number != selection->atoms[i - 1]->residue_number) {
+            (*spans)[current].length = i - (*spans)[current].start;
+            ++current;
+            (*spans)[current].start = i;
+        }
+    }
+    (*spans)[current].length = selection->n_atoms - (*spans)[current].start;
+
+    return n_residues;
+}
+
+/*
+ * FNV-1a hash. Start with FNV_OFFSET_BASIS and update the hash with each block of data.
+ */
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+static uint64_t fnv1a_update(uint64_t hash, const void *data, const size_t size)
+{
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+
+    return hash;
+}
+
+/*
+ * Open-addressing hash table mapping residue names to their index in a list_t of residue names.
+ * Keys point into the list_t which must outlive the table.
+ */
+typedef struct resname_table {
+    size_t capacity;
+    const char **keys;
+    size_t *indices;
+} resname_table_t;
+
+void resname_table_destroy(resname_table_t *table)
+{
+    if (table == NULL) return;
+    free(table->keys);
+    free(table->indices);
+    free(table);
+}
+
+/*
+ * Creates a hash table from a list of residue names.
+ * Returns pointer to the table or NULL if memory could not be allocated.
+ */
+resname_table_t *resname_table_create(const list_t *residue_names)
+{
+    resname_table_t *table = calloc(1, sizeof(resname_table_t));
+    if (table == NULL) return NULL;
+
+    // keep the load factor at most 0.5
+    table->capacity = 16;
+    while (table->capacity < 2 * residue_names->n_items) table->capacity *= 2;
+
+    table->keys = calloc(table->capacity, sizeof(const char *));
+    table->indices = calloc(table->capacity, sizeof(size_t));
+    if (table->keys == NULL || table->indices == NULL) {
+        resname_table_destroy(table);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < residue_names->n_items; ++i) {
+        const char *name = residue_names->items[i];
+        size_t slot = fnv1a_update(FNV_OFFSET_BASIS, name, strlen(name)) & (table->capacity - 1);
+        while (table->keys[slot] != NULL && strcmp(table->keys[slot], name) != 0) {
+            slot = (slot + 1) & (table->capacity - 1);
+        }
+
+        // keep the first occurrence, same as list_index
+        if (table->keys[slot] != NULL) continue;
+        table->keys[slot] = name;
+        table->indices[slot] = i;
+    }
+
+    return table;
+}
+
+/*
+ * Returns index of the residue name in the original list of residue names.
+ * Returns -1 if the residue name is not present in the table.
+ */
+int resname_table_get(const resname_table_t *table, const char *name)
+{
+    size_t slot = fnv1a_update(FNV_OFFSET_BASIS, name, strlen(name)) & (table->capacity - 1);
+    while (table->keys[slot] != NULL) {
+        if (strcmp(table->keys[slot], name) == 0) return (int) table->indices[slot];
+        slot = (slot + 1) & (table->capacity - 1);
+    }
+
+    return -1;
+}
+
+/*
+ * Assigns each atom of the `heads` selection to the residue containing it.
+ * `residues` are spans of the `membrane` selection which must contain atoms of `system`. For each residue, `heads_out` receives
+ * the index of its (first) head atom in the membrane selection and `counts_out` the number of head atoms it contains.
+ * Returns zero, if successful. Else returns non-zero.
+ */
+int index_heads(
+        const system_t *system,
+        const atom_selection_t *membrane,
+        const residue_span_t *residues,
+        const size_t n_residues,
+        const atom_selection_t *heads,
+        size_t **heads_out,
+        size_t **counts_out)
+{
+    // map atoms of the system to their position in the membrane selection
+    size_t *membrane_index = malloc(system->n_atoms * sizeof(size_t));
+    size_t *membrane_residue = malloc(membrane->n_atoms * sizeof(size_t));
+    *heads_out = calloc(n_residues, sizeof(size_t));
+    *counts_out = calloc(n_residues, sizeof(size_t));
+    if (membrane_index == NULL || membrane_residue == NULL || *heads_out == NULL || *counts_out == NULL) {
+        free(membrane_index);
+        free(membrane_residue);
+        free(*heads_out);
+        free(*counts_out);
+        return 1;
+    }
+
+    for (size_t i = 0; i < system->n_atoms; ++i) membrane_index[i] = SIZE_MAX;
+
+    for (size_t i = 0; i < n_residues; ++i) {
+        for (size_t j = residues[i].start; j < residues[i].start + residues[i].length; ++j) {
+            membrane_index[membrane->atoms[j] - system->atoms] = j;
+            membrane_residue[j] = i;
+        }
+    }
+
+    // single pass through the head atoms
+    for (size_t i = 0; i < heads->n_atoms; ++i) {
+        size_t index = membrane_index[heads->atoms[i] - system->atoms];
+        if (index == SIZE_MAX) continue;
+
+        size_t residue = membrane_residue[index];
+        if ((*counts_out)[residue] == 0) (*heads_out)[residue] = index;
+        ++(*counts_out)[residue];
+    }
+
+    free(membrane_index);
+    free(membrane_residue);
+    return 0;
+}
+
+/*
+ * Description of the membrane lipids depending only on the topology of the system, not on the coordinates.
+ * Created once and then used to classify lipids in any number of frames.
+ */
+typedef struct lipid_topology {
+    size_t n_atoms;             // number of atoms in the membrane selection
+    size_t *atoms;              // index of each atom of the membrane selection in the system
+    size_t n_residues;
+    residue_span_t *residues;   // spans of the membrane selection
+    size_t *heads;              // index of the head atom of each residue in the membrane selection
+    size_t *resnames;           // index of the residue name of each residue in the list of residue names
+    size_t n_resnames;
+    float *masses;              // mass of each atom of the membrane selection or NULL if masses are not used
+} lipid_topology_t;
+
+void topology_destroy(lipid_topology_t *topology)
+{
+    if (topology == NULL) return;
+    free(topology->atoms);
+    free(topology->residues);
+    free(topology->heads);
+    free(topology->resnames);
+    free(topology->masses);
+    free(topology);
+}
+
+/*
+ * Splits membrane into lipid residues, identifies their heads and residue names.
+ * Returns pointer to the lipid topology or NULL if the topology could not be constructed.
+ */
+lipid_topology_t *topology_create(
+        const system_t *system,
+        const atom_selection_t *membrane,
+        const atom_selection_t *phosphates,
+        const list_t *residue_names)
+{
+    lipid_topology_t *topology = calloc(1, sizeof(lipid_topology_t));
+    if (topology == NULL) {
+        fprintf(stderr, "Could not allocate memory for lipid topology.\n");
+        return NULL;
+    }
+    topology->n_resnames = residue_names->n_items;
+
+    topology->n_atoms = membrane->n_atoms;
+    topology->atoms = malloc(membrane->n_atoms * sizeof(size_t));
+    if (topology->atoms == NULL) {
+        fprintf(stderr, "Could not allocate memory for lipid topology.\n");
+        topology_destroy(topology);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < membrane->n_atoms; ++i) topology->atoms[i] = membrane->atoms[i] - system->atoms;
+
+    // split lipid atoms into individual residues
+    topology->n_residues = split_residues(membrane, &topology->residues);
+    if (topology->residues == NULL || topology->n_residues == 0) {
+        fprintf(stderr, "Could not split atoms based on residue number.\n");
+        topology_destroy(topology);
+        return NULL;
+    }
+
+    // find phosphates of all residues in one pass
+    size_t *n_heads = NULL;
+    if (index_heads(system, membrane, topology->residues, topology->n_residues, phosphates, &topology->heads, &n_heads) != 0) {
+        fprintf(stderr, "Could not assign phosphates to lipid residues.\n");
+        topology_destroy(topology);
+        return NULL;
+    }
+
+    // prepare lookup of ndx groups by residue name
+    resname_table_t *resname_table = resname_table_create(residue_names);
+    topology->resnames = malloc(topology->n_residues * sizeof(size_t));
+    if (resname_table == NULL || topology->resnames == NULL) {
+        fprintf(stderr, "Could not create a table of residue names.\n");
+        goto topology_create_fail;
+    }
+
+    for (size_t i = 0; i < topology->n_residues; ++i) {
+        atom_t *const *residue_atoms = &membrane->atoms[topology->residues[i].start];
+        char *resname = residue_atoms[0]->residue_name;
+
+        // get lipid phosphate
+        if (n_heads[i] == 0) {
+            fprintf(stderr, "No phosphate detected for lipid %s (resid %d).\n", resname, residue_atoms[0]->residue_number);
+            goto topology_create_fail;
+        }
+        if (n_heads[i] > 1) {
+            fprintf(stderr, "Multiple phosphates detected for lipid %s (resid %d).\n", resname, residue_atoms[0]->residue_number);
+            goto topology_create_fail;
+        }
+
+        int index = resname_table_get(resname_table, resname);
+        if (index < 0) {
+            fprintf(stderr, "Internal Error. Inconsistency in residue names. Residue name %s of resid %d was not found in a list of detected residue names.\n", resname, residue_atoms[0]->residue_number);
+            fprintf(stderr, "This should never happen.\n");
+            goto topology_create_fail;
+        }
+
+        topology->resnames[i] = (size_t) index;
+    }
+
+    resname_table_destroy(resname_table);
+    free(n_heads);
+    return topology;
+
+    topology_create_fail:
+    resname_table_destroy(resname_table);
+    free(n_heads);
+    topology_destroy(topology);
+    return NULL;
+}
+
+/*
+ * Calculates fingerprint of everything the lipid topology depends on: atom names, residue names and residue numbers
+ * of all atoms, the selection queries and the size and modification time of the ndx file.
+ */
+uint64_t topology_fingerprint(const system_t *system, const char *selected, const char *phosphate, const char *ndx_file)
+{
+    uint64_t hash = FNV_OFFSET_BASIS;
+    uint64_t n_atoms = system->n_atoms;
+    hash = fnv1a_update(hash, &n_atoms, sizeof(n_atoms));
+
+    for (size_t i = 0; i < system->n_atoms; ++i) {
+        const atom_t *atom = &system->atoms[i];
+        int32_t residue_number = atom->residue_number;
+        hash = fnv1a_update(hash, &residue_number, sizeof(residue_number));
+        hash = fnv1a_update(hash, atom->residue_name, strlen(atom->residue_name) + 1);
+        hash = fnv1a_update(hash, atom->atom_name, strlen(atom->atom_name) + 1);
+    }
+
+    hash = fnv1a_update(hash, selected, strlen(selected) + 1);
+    hash = fnv1a_update(hash, phosphate, strlen(phosphate) + 1);
+
+    struct stat info;
+    int64_t ndx_info[3] = { -1, 0, 0 };
+    if (stat(ndx_file, &info) == 0) {
+        ndx_info[0] = (int64_t) info.st_size;
+        ndx_info[1] = (int64_t) info.st_mtim.tv_sec;
+        ndx_info[2] = (int64_t) info.st_mtim.tv_nsec;
+    }
+    return fnv1a_update(hash, ndx_info, sizeof(ndx_info));
+}
+
+/*
+ * Binary cache of the lipid topology.
+ * Layout: header, atoms (uint32_t), residue starts (uint32_t), heads (uint32_t), residue name indices (uint32_t),
+ * residue names (null-terminated strings).
+ */
+#define TOPOLOGY_CACHE_MAGIC "L2NDXTOP"
+#define TOPOLOGY_CACHE_VERSION 1
+
+typedef struct topology_cache_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t fingerprint;
+    uint64_t n_system_atoms;
+    uint64_t n_atoms;
+    uint64_t n_residues;
+    uint64_t n_resnames;
+    uint64_t names_size;
+} topology_cache_header_t;
+
+/*
+ * Writes the lipid topology and residue names into the cache file.
+ * Returns zero, if successful. Else returns non-zero.
+ */
+int topology_cache_write(const char *path, const uint64_t fingerprint, const system_t *system, const lipid_topology_t *topology, const list_t *residue_names)
+{
+    // indices are stored as 32-bit numbers
+    if (system->n_atoms > UINT32_MAX) return 1;
+
+    size_t names_size = 0;
+    for (size_t i = 0; i < residue_names->n_items; ++i) names_size += strlen(list_get(residue_names, i)) + 1;
+
+    size_t size = sizeof(topology_cache_header_t) + (topology->n_atoms + 3 * topology->n_residues) * sizeof(uint32_t) + names_size;
+    char *cache = calloc(1, size);
+    if (cache == NULL) return 1;
+
+    topology_cache_header_t *header = (topology_cache_header_t *) cache;
+    memcpy(header->magic, TOPOLOGY_CACHE_MAGIC, 8);
+    header->version = TOPOLOGY_CACHE_VERSION;
+    header->fingerprint = fingerprint;
+    header->n_system_atoms = system->n_atoms;
+    header->n_atoms = topology->n_atoms;
+    header->n_residues = topology->n_residues;
+    header->n_resnames = residue_names->n_items;
+    header->names_size = names_size;
+
+    uint32_t *atoms = (uint32_t *) (cache + sizeof(topology_cache_header_t));
+    uint32_t *starts = atoms + topology->n_atoms;
+    uint32_t *heads = starts + topology->n_residues;
+    uint32_t *resnames = heads + topology->n_residues;
+    for (size_t i = 0; i < topology->n_atoms; ++i) atoms[i] = (uint32_t) topology->atoms[i];
+    for (size_t i = 0; i < topology->n_residues; ++i) {
+        starts[i] = (uint32_t) topology->residues[i].start;
+        heads[i] = (uint32_t) topology->heads[i];
+        resnames[i] = (uint32_t) topology->resnames[i];
+    }
+
+    char *names = (char *) (resnames + topology->n_residues);
+    for (size_t i = 0; i < residue_names->n_items; ++i) {
+        size_t length = strlen(list_get(residue_names, i)) + 1;
+        memcpy(names, list_get(residue_names, i), length);
+        names += length;
+    }
+
+    int error = write_file_atomically(path, cache, size);
+    free(cache);
+    return error;
+}
+
+/*
+ * Creates the lipid topology from the cache data after checking that the cache is consistent.
+ * Returns pointer to the topology and stores the residue names into `residue_names` or returns NULL if the cache is not valid.
+ */
+static lipid_topology_t *topology_cache_parse(const char *cache, const size_t size, const uint64_t fingerprint, const system_t *system, list_t **residue_names)
+{
+    const topology_cache_header_t *header = (const topology_cache_header_t *) cache;
+    if (size < sizeof(topology_cache_header_t) ||
+            memcmp(header->magic, TOPOLOGY_CACHE_MAGIC, 8) != 0 ||
+            header->version != TOPOLOGY_CACHE_VERSION ||
+            header->fingerprint != fingerprint ||
+            header->n_system_atoms != system->n_atoms ||
+            header->n_atoms == 0 || header->n_residues == 0 ||
+            header->n_atoms > system->n_atoms || header->n_residues > header->n_atoms ||
+            size != sizeof(topology_cache_header_t) + (header->n_atoms + 3 * header->n_residues) * sizeof(uint32_t) + header->names_size) return NULL;
+
+    const uint32_t *atoms = (const uint32_t *) (cache + sizeof(topology_cache_header_t));
+    const uint32_t *starts = atoms + header->n_atoms;
+    const uint32_t *heads = starts + header->n_residues;
+    const uint32_t *resnames = heads + header->n_residues;
+    const char *names = (const char *) (resnames + header->n_residues);
+    if (header->names_size == 0 || names[header->names_size - 1] != '\0') return NULL;
+
+    lipid_topology_t *topology = calloc(1, sizeof(lipid_topology_t));
+    *residue_names = list_create();
+    if (topology == NULL || *residue_names == NULL) goto cache_parse_fail;
+
+    for (const char *name = names; name < names + header->names_size; name += strlen(name) + 1) list_append(*residue_names, name);
+    if ((*residue_names)->n_items != header->n_resnames) goto cache_parse_fail;
+
+    topology->n_atoms = header->n_atoms;
+    topology->n_residues = header->n_residues;
+    topology->n_resnames = header->n_resnames;
+    topology->atoms = malloc(topology->n_atoms * sizeof(size_t));
+    topology->residues = malloc(topology->n_residues * sizeof(residue_span_t));
+    topology->heads = malloc(topology->n_residues * sizeof(size_t));
+    topology->resnames = malloc(topology->n_residues * sizeof(size_t));
+    if (topology->atoms == NULL || topology->residues == NULL || topology->heads == NULL || topology->resnames == NULL) goto cache_parse_fail;
+
+    for (size_t i = 0; i < topology->n_atoms; ++i) {
+        if (atoms[i] >= system->n_atoms) goto cache_parse_fail;
+        topology->atoms[i] = atoms[i];
+    }
+
+    for (size_t i = 0; i < topology->n_residues; ++i) {
+        size_t end = i + 1 < topology->n_residues ? starts[i + 1] : topology->n_atoms;
+        if ((i == 0 && starts[i] != 0) || starts[i] >= end || end > topology->n_atoms) goto cache_parse_fail;
+        if (heads[i] < starts[i] || heads[i] >= end || resnames[i] >= topology->n_resnames) goto cache_parse_fail;
+
+        topology->residues[i].start = starts[i];
+        topology->residues[i].length = end - starts[i];
+        topology->heads[i] = heads[i];
+        topology->resnames[i] = resnames[i];
+    }
+
+    return topology;
+
+    cache_parse_fail:
+    topology_destroy(topology);
+    if (*residue_names != NULL) list_destroy(*residue_names);
+    *residue_names = NULL;
+    return NULL;
+}
+
+/*
+ * Reads the lipid topology from the cache file, if the cache exists and belongs to a system with the given fingerprint.
+ * Returns pointer to the topology and stores the residue names into `residue_names` or returns NULL if the cache cannot be used.
+ */
+lipid_topology_t *topology_cache_read(const char *path, const uint64_t fingerprint, const system_t *system, list_t **residue_names)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+
+    size_t size = (size_t) info.st_size;
+    char *cache = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (cache == MAP_FAILED) return NULL;
+
+    lipid_topology_t *topology = topology_cache_parse(cache, size, fingerprint, system, residue_names);
+    munmap(cache, size);
+    return topology;
+}
+
+/*
+ * Creates the selection of membrane lipids from the lipid topology.
+ * Returns pointer to the selection or NULL if memory could not be allocated.
+ */
+atom_selection_t *topology_membrane(const lipid_topology_t *topology, system_t *system)
+{
+    atom_selection_t *membrane = selection_create(topology->n_atoms);
+    if (membrane == NULL) return NULL;
+
+    for (size_t i = 0; i < topology->n_atoms; ++i) membrane->atoms[i] = &system->atoms[topology->atoms[i]];
+    membrane->n_atoms = topology->n_atoms;
+
+    return membrane;
+}
+
+/*
+ * Masses of regular and small Martini 3 beads.
+ */
+#define REGULAR_BEAD_MASS 72.0f
+#define SMALL_BEAD_MASS 54.0f
+
+/*
+ * Masses of beads of coarse-grained (Martini 3) lipids which are not tail beads. Glycerol, inositol and sterol beads
+ * are small. Characteristic beads identify coarse-grained lipids; the others could also be names of atoms.
+ */
+typedef struct bead {
+    const char *name;
+    float mass;
+    int characteristic;
+} bead_t;
+
+static const bead_t BEADS[] = {
+    { "NC3", REGULAR_BEAD_MASS, 1 },
+    { "NH3", REGULAR_BEAD_MASS, 1 },
+    { "CNO", REGULAR_BEAD_MASS, 1 },
+    { "PO4", REGULAR_BEAD_MASS, 1 },
+    { "PO41", REGULAR_BEAD_MASS, 1 },
+    { "PO42", REGULAR_BEAD_MASS, 1 },
+    { "GL0", SMALL_BEAD_MASS, 1 },
+    { "GL1", SMALL_BEAD_MASS, 1 },
+    { "GL2", REGULAR_BEAD_MASS, 1 },
+    { "AM1", REGULAR_BEAD_MASS, 1 },
+    { "AM2", REGULAR_BEAD_MASS, 1 },
+    { "ROH", SMALL_BEAD_MASS, 1 },
+    { "R1", SMALL_BEAD_MASS, 1 },
+    { "R2", SMALL_BEAD_MASS, 1 },
+    { "R3", SMALL_BEAD_MASS, 1 },
+    { "R4", SMALL_BEAD_MASS, 1 },
+    { "R5", SMALL_BEAD_MASS, 1 },
+    { "C1", SMALL_BEAD_MASS, 0 },
+    { "C2", SMALL_BEAD_MASS, 0 },
+    { "C3", SMALL_BEAD_MASS, 0 },
+};
+
+/*
+ * Returns the mass of a coarse-grained (Martini 3) lipid bead or a negative number if the bead is not known.
+ * Tail beads (named e.g. C1A or D2B) are regular, virtual sites (named VS...) have no mass.
+ * If `characteristic` is non-zero, only beads identifying coarse-grained lipids are considered.
+ */
+static float bead_mass(const char *name, const int characteristic)
+{
+    if ((name[0] == 'C' || name[0] == 'D') && name[1] >= '1' && name[1] <= '6' && name[2] >= 'A' && name[2] <= 'D' && name[3] == '\0') {
+        return REGULAR_BEAD_MASS;
+    }
+
+    if (!characteristic && !strncmp(name, "VS", 2)) return 0.0f;
+
+    for (size_t i = 0; i < sizeof(BEADS) / sizeof(bead_t); ++i) {
+        if (!strcmp(name, BEADS[i].name) && (BEADS[i].characteristic || !characteristic)) return BEADS[i].mass;
+    }
+
+    return -1.0f;
+}
+
+/*
+ * Guesses mass of an all-atom particle from its atom name. The element is identified by the first letter of the name
+ * (leading digits, e.g. of hydrogens named 1H2, are skipped).
+ * Returns the mass or a negative number if the element is not known.
+ */
+static float element_mass(const char *name)
+{
+    while (*name >= '0' && *name <= '9') ++name;
+
+    switch (*name) {
+    case 'H': return 1.008f;
+    case 'C': return 12.011f;
+    case 'N': return 14.007f;
+    case 'O': return 15.999f;
+    case 'P': return 30.974f;
+    case 'S': return 32.06f;
+    default: return -1.0f;
+    }
+}
+
+/*
+ * Mass of an atom identified by its name and optionally by the name of its residue (read from the file of masses).
+ */
+typedef struct named_mass {
+    char residue[16];   // empty string matches any residue
+    char name[16];
+    float mass;
+} named_mass_t;
+
+/*
+ * Reads masses from a file. Each line contains an optional residue name, an atom name and the mass.
+ * Empty lines and lines starting with '#' or ';' are skipped.
+ * Returns the number of masses and stores them in `masses` or returns 0 if the file could not be read.
+ */
+static size_t read_masses(const char *filename, named_mass_t **masses)
+{
+    *masses = NULL;
+    FILE *file = fopen(filename, "r");
+    if (file == NULL) {
+        fprintf(stderr, "File %s could not be read.\n", filename);
+        return 0;
+    }
+
+    size_t n_masses = 0, allocated = 0;
+    char line[1024] = "";
+    for (size_t line_number = 1; fgets(line, sizeof(line), file) != NULL; ++line_number) {
+        char tokens[3][16] = { "", "", "" };
+        char rest[2] = "";
+        int n_tokens = sscanf(line, "%15s %15s %15s %1s", tokens[0], tokens[1], tokens[2], rest);
+        if (n_tokens <= 0 || tokens[0][0] == '#' || tokens[0][0] == ';') continue;
+
+        named_mass_t mass = { "", "", 0.0f };
+        char *end = NULL;
+        if (n_tokens == 2) {
+            strcpy(mass.name, tokens[0]);
+            mass.mass = strtof(tokens[1], &end);
+        } else if (n_tokens == 3) {
+            strcpy(mass.residue, tokens[0]);
+            strcpy(mass.name, tokens[1]);
+            mass.mass = strtof(tokens[2], &end);
+        }
+
+        if (end == NULL || *end != '\0' || mass.mass < 0.0f) {
+            fprintf(stderr, "Could not parse line %zu of file %s. Expected '[RESIDUE] NAME MASS'.\n", line_number, filename);
+            free(*masses);
+            *masses = NULL;
+            fclose(file);
+            return 0;
+        }
+
+        if (n_masses >= allocated) {
+            allocated = allocated == 0 ? 16 : 2 * allocated;
+            named_mass_t *reallocated = realloc(*masses, allocated * sizeof(named_mass_t));
+            if (reallocated == NULL) {
+                fprintf(stderr, "Could not allocate memory for atom masses.\n");
+                free(*masses);
+                *masses = NULL;
+                fclose(file);
+                return 0;
+            }
+            *masses = reallocated;
+        }
+
+        (*masses)[n_masses++] = mass;
+    }
+
+    fclose(file);
+    if (n_masses == 0) fprintf(stderr, "No masses found in file %s.\n", filename);
+    return n_masses;
+}
+
+/*
+ * Returns the mass of an atom given in `masses` or a negative number if it is not given.
+ * Masses given for the residue of the atom take precedence over masses given for any residue.
+ */
+static float given_mass(const named_mass_t *masses, const size_t n_masses, const atom_t *atom)
+{
+    float mass = -1.0f;
+    for (size_t i = 0; i < n_masses; ++i) {
+        if (strcmp(atom->atom_name, masses[i].name)) continue;
+        if (!strcmp(atom->residue_name, masses[i].residue)) return masses[i].mass;
+        if (masses[i].residue[0] == '\0') mass = masses[i].mass;
+    }
+
+    return mass;
+}
+
+/*
+ * Assigns a mass to each atom of the membrane selection.
+ * Masses given in `masses_file` (if not NULL) take precedence. Otherwise, a lipid residue containing any bead
+ * of coarse-grained (Martini 3) lipids is coarse-grained and its beads get masses based on their size.
+ * Atoms of other residues are assigned masses of elements guessed from their names.
+ * Returns zero, if successful. Else returns non-zero.
+ */
+int topology_masses(lipid_topology_t *topology, const system_t *system, const char *masses_file)
+{
+    named_mass_t *masses = NULL;
+    size_t n_masses = 0;
+    if (masses_file != NULL && (n_masses = read_masses(masses_file, &masses)) == 0) return 1;
+
+    topology->masses = calloc(topology->n_atoms, sizeof(float));
+    if (topology->masses == NULL) {
+        fprintf(stderr, "Could not allocate memory for atom masses.\n");
+        free(masses);
+        return 1;
+    }
+
+    double total = 0.0;
+    for (size_t r = 0; r < topology->n_residues; ++r) {
+        const residue_span_t *residue = &topology->residues[r];
+
+        int coarse_grained = 0;
+        for (size_t i = residue->start; i < residue->start + residue->length && !coarse_grained; ++i) {
+            coarse_grained = bead_mass(system->atoms[topology->atoms[i]].atom_name, 1) >= 0.0f;
+        }
+
+        for (size_t i = residue->start; i < residue->start + residue->length; ++i) {
+            const atom_t *atom = &system->atoms[topology->atoms[i]];
+            float mass = given_mass(masses, n_masses, atom);
+            if (mass < 0.0f) mass = coarse_grained ? bead_mass(atom->atom_name, 0) : element_mass(atom->atom_name);
+
+            if (mass < 0.0f) {
+                fprintf(stderr, "Could not guess mass of %s %s of residue %s. Specify it using --masses.\n",
+                        coarse_grained ? "coarse-grained bead" : "atom", atom->atom_name, atom->residue_name);
+                free(masses);
+                free(topology->masses);
+                topology->masses = NULL;
+                return 1;
+            }
+
+            topology->masses[i] = mass;
+            total += mass;
+        }
+    }
+
+    free(masses);
+    if (total <= 0.0) {
+        fprintf(stderr, "Total mass of membrane atoms is zero.\n");
+        free(topology->masses);
+        topology->masses = NULL;
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Reads the ndx file, selects membrane lipids and their heads and creates the lipid topology.
+ * Returns pointer to the topology and stores the membrane selection and the residue names or returns NULL if this failed.
+ */
+lipid_topology_t *select_topology(
+        system_t *system,
+        const char *ndx_file,
+        const int ndx_cache,
+        char *selected,
+        char *phosphate,
+        atom_selection_t **membrane,
+        list_t **residue_names,
+        timings_t *timings)
+{
+    // read ndx groups referenced by the selections; ignore if this fails
+    double start = monotonic_seconds();
+    const char *queries[] = { selected, phosphate };
+    dict_t *ndx_groups = ndx_cache ? read_ndx_cached(ndx_file, system, queries, 2) : read_ndx_lazy(ndx_file, system, queries, 2);
+    timings_add(timings, PHASE_READ_NDX, start, system->n_atoms);
+
+    lipid_topology_t *topology = NULL;
+    atom_selection_t *phosphates = NULL;
+
+    // select all atoms
+    atom_selection_t *all = select_system(system);
+
+    // select membrane lipids
+    start = monotonic_seconds();
+    *membrane = smart_select(all, selected, ndx_groups);
+    timings_add(timings, PHASE_SELECT_MEMBRANE, start, all->n_atoms);
+    if (*membrane == NULL) {
+        fprintf(stderr, "Could not understand the selection query '%s'.\n", selected);
+        goto select_end;
+    }
+
+    if ((*membrane)->n_atoms == 0) {
+        fprintf(stderr, "No membrane lipids ('%s') found.\n", selected);
+        goto select_end;
+    }
+
+    // select phosphates
+    start = monotonic_seconds();
+    phosphates = smart_select(all, phosphate, ndx_groups);
+    timings_add(timings, PHASE_SELECT_HEADS, start, all->n_atoms);
+    if (phosphates == NULL || phosphates->n_atoms == 0) {
+        fprintf(stderr, "No phosphates ('%s') found.\n", phosphate);
+        goto select_end;
+    }
+
+    // get residue names
+    start = monotonic_seconds();
+    *residue_names = selection_getresnames(*membrane);
+
+    // prepare lipid topology; this is done only once even for trajectories
+    topology = topology_create(system, *membrane, phosphates, *residue_names);
+    timings_add(timings, PHASE_SPLIT_RESIDUES, start, (*membrane)->n_atoms);
+    if (topology == NULL) fprintf(stderr, "Failed to create ndx groups.\n");
+
+    select_end:
+    if (topology == NULL) {
+        free(*membrane);
+        *membrane = NULL;
+        if (*residue_names != NULL) list_destroy(*residue_names);
+        *residue_names = NULL;
+    }
+    if (ndx_groups != NULL) dict_destroy(ndx_groups);
+    free(phosphates);
+    free(all);
+    return topology;
+}
+
+/*
+ * Coordinates of the membrane atoms in a single simulation frame and the leaflets assigned to the lipids in this frame.
+ */
+typedef struct frame {
+    size_t index;
+    box_t box;
+    vec_t *coordinates;     // in the order of the membrane selection
+    size_t *leaflets;       // leaflet of each lipid residue: 1 -> upper, 0 -> lower, or index of the leaflet (METHOD_STACK)
+    size_t n_leaflets;      // number of leaflets in the frame
+    ndx_writer_t *output;   // memory buffer used when frames are processed in parallel
+    timings_t timings;      // time spent processing the frame
+} frame_t;
+
+void frame_destroy(frame_t *frame)
+{
+    if (frame == NULL) return;
+    free(frame->coordinates);
+    free(frame->leaflets);
+    if (frame->output != NULL) {
+        free(frame->output->buffer);
+        free(frame->output);
+    }
+    free(frame);
+}
+
+/*
+ * Creates a frame for the membrane described by topology. If `buffered` is non-zero, the frame gets its own output buffer.
+ * Returns pointer to the frame or NULL if memory could not be allocated.
+ */
+frame_t *frame_create(const lipid_topology_t *topology, const int buffered)
+{
+    frame_t *frame = calloc(1, sizeof(frame_t));
+    if (frame == NULL) return NULL;
+
+    frame->coordinates = malloc(topology->n_atoms * sizeof(vec_t));
+    frame->leaflets = malloc(topology->n_residues * sizeof(size_t));
+    if (buffered) frame->output = ndx_writer_create_memory();
+
+    if (frame->coordinates == NULL || frame->leaflets == NULL || (buffered && frame->output == NULL)) {
+        frame_destroy(frame);
+        return NULL;
+    }
+
+    return frame;
+}
+
+/*
+ * Copies the box and the coordinates of the membrane atoms from the system into the frame.
+ */
+void frame_load(frame_t *frame, const lipid_topology_t *topology, const system_t *system, const size_t index)
+{
+    frame->index = index;
+    memcpy(frame->box, system->box, sizeof(box_t));
+    for (size_t i = 0; i < topology->n_atoms; ++i) {
+        memcpy(frame->coordinates[i], system->atoms[topology->atoms[i]].position, sizeof(vec_t));
+    }
+}
+
+/*
+ * Number of independent accumulators used by the center kernel.
+ * The accumulators are updated in lock-step, so that the compiler can vectorize the loop without reordering floating point sums.
+ */
+#define CENTER_LANES 8
+
+/*
+ * Minimal number of atoms per thread for which calculating the membrane center in multiple threads pays off.
+ */
+#define CENTER_ATOMS_PER_THREAD 262144
+
+/*
+ * Calculates cosine and sine of the angle 2 * pi * `turns`.
+ * The angle is reduced to half a turn and sine and cosine of its half are evaluated using Taylor polynomials
+ * (error below 1e-12), so that there are no calls to libm and the function can be vectorized.
+ */
+static inline void turn_cos_sin(const double turns, double *cosine, double *sine)
+{
+    // round to the nearest integer by adding and subtracting 1.5 * 2^52
+    const double shift = 6755399441055744.0;
+    double reduced = turns - ((turns + shift) - shift);
+
+    double h = M_PI * reduced;
+    double h2 = h * h;
+    double sin_h = h * (1.0 + h2 * (-1.0 / 6.0 + h2 * (1.0 / 120.0 + h2 * (-1.0 / 5040.0 + h2 * (1.0 / 362880.0 
+            + h2 * (-1.0 / 39916800.0 + h2 * (1.0 / 6227020800.0 + h2 * (-1.0 / 1307674368000.0 + h2 * (1.0 / 355687428096000.0)))))))));
+    double cos_h = 1.0 + h2 * (-1.0 / 2.0 + h2 * (1.0 / 24.0 + h2 * (-1.0 / 720.0 + h2 * (1.0 / 40320.0 
+            + h2 * (-1.0 / 3628800.0 + h2 * (1.0 / 479001600.0 + h2 * (-1.0 / 87178291200.0 + h2 * (1.0 / 20922789888000.0))))))));
+
+    *cosine = 1.0 - 2.0 * sin_h * sin_h;
+    *sine = 2.0 * sin_h * cos_h;
+}
+
+/*
+ * Accumulates cosines and sines of the positions of atoms `start` to `end` along each dimension,
+ * with the box length being one full turn. `sums` holds the sums of cosines followed by the sums of sines.
+ * If `masses` is not NULL, the cosines and sines are weighted by the masses of the atoms.
+ * The coordinates of CENTER_LANES consecutive atoms are contiguous in memory, so they are processed as one flat block
+ * with a separate accumulator for each coordinate.
+ * Returns the total weight of the atoms.
+ */
+static double center_sums(const vec_t *coordinates, const float *masses, const size_t start, const size_t end, const box_t box, double sums[6])
+{
+    double inverse[3 * CENTER_LANES] = { 0.0 };
+    double lanes_cos[3 * CENTER_LANES] = { 0.0 };
+    double lanes_sin[3 * CENTER_LANES] = { 0.0 };
+    double lanes_mass[CENTER_LANES] = { 0.0 };
+    for (int k = 0; k < 3 * CENTER_LANES; ++k) inverse[k] = 1.0 / box[k % 3];
+
+    size_t i = start;
+    if (masses == NULL) {
+        for (; i + CENTER_LANES <= end; i += CENTER_LANES) {
+            const float *block = coordinates[i];
+            for (int k = 0; k < 3 * CENTER_LANES; ++k) {
+                double cosine, sine;
+                turn_cos_sin(block[k] * inverse[k], &cosine, &sine);
+                lanes_cos[k] += cosine;
+                lanes_sin[k] += sine;
+            }
+        }
+    } else {
+        // masses are read in the same pass as the coordinates
+        for (; i + CENTER_LANES <= end; i += CENTER_LANES) {
+            const float *block = coordinates[i];
+            for (int k = 0; k < 3 * CENTER_LANES; ++k) {
+                double cosine, sine;
+                turn_cos_sin(block[k] * inverse[k], &cosine, &sine);
+                lanes_cos[k] += masses[i + k / 3] * cosine;
+                lanes_sin[k] += masses[i + k / 3] * sine;
+            }
+            for (int lane = 0; lane < CENTER_LANES; ++lane) lanes_mass[lane] += masses[i + lane];
+        }
+    }
+    for (; i < end; ++i) {
+        double mass = masses == NULL ? 1.0 : masses[i];
+        for (int dim = 0; dim < 3; ++dim) {
+            double cosine, sine;
+            turn_cos_sin(coordinates[i][dim] * inverse[dim], &cosine, &sine);
+            lanes_cos[dim] += mass * cosine;
+            lanes_sin[dim] += mass * sine;
+        }
+        lanes_mass[0] += mass;
+    }
+
+    for (int dim = 0; dim < 3; ++dim) {
+        sums[dim] = 0.0;
+        sums[3 + dim] = 0.0;
+    }
+    for (int k = 0; k < 3 * CENTER_LANES; ++k) {
+        sums[k % 3] += lanes_cos[k];
+        sums[3 + k % 3] += lanes_sin[k];
+    }
+
+    if (masses == NULL) return (double) (end - start);
+
+    double total = 0.0;
+    for (int lane = 0; lane < CENTER_LANES; ++lane) total += lanes_mass[lane];
+    return total;
+}
+
+/*
+ * Part of the membrane processed by a single thread of the center kernel.
+ */
+typedef struct center_task {
+    const vec_t *coordinates;
+    const float *masses;
+    size_t start;
+    size_t end;
+    const float *box;
+    double sums[6];
+    double weight;
+} center_task_t;
+
+static void *center_worker(void *arg)
+{
+    center_task_t *task = arg;
+    task->weight = center_sums(task->coordinates, task->masses, task->start, task->end, task->box, task->sums);
+    return NULL;
+}
+
+/*
+ * Calculates center of geometry of the membrane atoms in the frame, taking periodic boundary conditions into account.
+ * If `masses` is not NULL, calculates center of mass instead.
+ * Uses the circular mean approach of Bai & Breen, same as groan's center_of_geometry.
+ * Large membranes are split between up to `n_threads` threads. Partial sums are combined in a fixed order,
+ * so the result only depends on the number of threads used.
+ * Returns zero, if successful. Else returns non-zero.
+ */
+int membrane_center(const frame_t *frame, const size_t n_atoms, const float *masses, const size_t n_threads, vec_t center)
+{
+    if (n_atoms == 0) return 1;
+    for (int dim = 0; dim < 3; ++dim) {
+        if (frame->box[dim] <= 0.0f) return 1;
+    }
+
+    size_t n_tasks = n_atoms / CENTER_ATOMS_PER_THREAD;
+    if (n_tasks > n_threads) n_tasks = n_threads;
+    if (n_tasks < 1) n_tasks = 1;
+
+    center_task_t *tasks = calloc(n_tasks, sizeof(center_task_t));
+    pthread_t *threads = calloc(n_tasks, sizeof(pthread_t));
+    int *started = calloc(n_tasks, sizeof(int));
+    if (tasks == NULL || threads == NULL || started == NULL) {
+        free(tasks);
+        free(threads);
+        free(started);
+        return 1;
+    }
+
+    for (size_t t = 0; t < n_tasks; ++t) {
+        tasks[t].coordinates = (const vec_t *) frame->coordinates;
+        tasks[t].masses = masses;
+        tasks[t].start = n_atoms * t / n_tasks;
+        tasks[t].end = n_atoms * (t + 1) / n_tasks;
+        tasks[t].box = frame->box;
+    }
+
+    // the first part is processed by the calling thread; parts of threads which could not be started as well
+    for (size_t t = 1; t < n_tasks; ++t) {
+        started[t] = pthread_create(&threads[t], NULL, center_worker, &tasks[t]) == 0;
+    }
+    center_worker(&tasks[0]);
+    for (size_t t = 1; t < n_tasks; ++t) {
+        if (started[t]) pthread_join(threads[t], NULL);
+        else center_worker(&tasks[t]);
+    }
+
+    double sums[6] = { 0.0 };
+    double weight = 0.0;
+    for (size_t t = 0; t < n_tasks; ++t) {
+        for (int k = 0; k < 6; ++k) sums[k] += tasks[t].sums[k];
+        weight += tasks[t].weight;
+    }
+
+    for (int dim = 0; dim < 3; ++dim) {
+        double theta = atan2(-sums[3 + dim] / weight, -sums[dim] / weight) + M_PI;
+        center[dim] = (float) (theta / (2.0 * M_PI) * frame->box[dim]);
+    }
+
+    free(tasks);
+    free(threads);
+    free(started);
+    return 0;
+}
+
+/*
+ * Returns the minimum image of a distance `d` along a periodic dimension of length `box`.
+ */
+static inline float minimum_image(const float d, const float box)
+{
+    return d - box * roundf(d / box);
+}
+
+/*
+ * Estimates the membrane normal as the direction of the smallest variance of the membrane atoms around the membrane center.
+ * The covariance matrix is accumulated in a single pass over the atoms and diagonalized using Jacobi rotations.
+ * The normal is oriented so that its largest component is positive.
+ * Returns zero, if successful. Else returns non-zero.
+ */
+int membrane_normal(const frame_t *frame, const size_t n_atoms, const vec_t center, double normal[3])
+{
+    if (n_atoms < 3) return 1;
+
+    // sums of displacements and of their products: xx, yy, zz, xy, xz, yz
+    double sums[3] = { 0.0 };
+    double products[6] = { 0.0 };
+    for (size_t i = 0; i < n_atoms; ++i) {
+        double d[3];
+        for (int dim = 0; dim < 3; ++dim) {
+            d[dim] = minimum_image(frame->coordinates[i][dim] - center[dim], frame->box[dim]);
+            sums[dim] += d[dim];
+        }
+
+        products[0] += d[0] * d[0];
+        products[1] += d[1] * d[1];
+        products[2] += d[2] * d[2];
+        products[3] += d[0] * d[1];
+        products[4] += d[0] * d[2];
+        products[5] += d[1] * d[2];
+    }
+
+    double mean[3] = { sums[0] / n_atoms, sums[1] / n_atoms, sums[2] / n_atoms };
+    double a[3][3] = { { 0.0 } };
+    a[0][0] = products[0] / n_atoms - mean[0] * mean[0];
+    a[1][1] = products[1] / n_atoms - mean[1] * mean[1];
+    a[2][2] = products[2] / n_atoms - mean[2] * mean[2];
+    a[0][1] = a[1][0] = products[3] / n_atoms - mean[0] * mean[1];
+    a[0][2] = a[2][0] = products[4] / n_atoms - mean[0] * mean[2];
+    a[1][2] = a[2][1] = products[5] / n_atoms - mean[1] * mean[2];
+
+    // Jacobi eigenvalue algorithm; columns of v are the eigenvectors
+    double v[3][3] = { { 1.0, 0.0, 0.0 }, { 0.0, 1.0, 0.0 }, { 0.0, 0.0, 1.0 } };
+    for (int sweep = 0; sweep < 50; ++sweep) {
+        double off = a[0][1] * a[0][1] + a[0][2] * a[0][2] + a[1][2] * a[1][2];
+        double diagonal = a[0][0] * a[0][0] + a[1][1] * a[1][1] + a[2][2] * a[2][2];
+        if (off <= 1e-24 * diagonal) break;
+
+        for (int p = 0; p < 2; ++p) {
+            for (int q = p + 1; q < 3; ++q) {
+                if (a[p][q] == 0.0) continue;
+
+                double theta = (a[q][q] - a[p][p]) / (2.0 * a[p][q]);
+                double t = (theta >= 0.0 ? 1.0 : -1.0) / (fabs(theta) + sqrt(theta * theta + 1.0));
+                double c = 1.0 / sqrt(t * t + 1.0);
+                double s = t * c;
+
+                for (int k = 0; k < 3; ++k) {
+                    double akp = a[k][p], akq = a[k][q];
+                    a[k][p] = c * akp - s * akq;
+                    a[k][q] = s * akp + c * akq;
+                }
+                for (int k = 0; k < 3; ++k) {
+                    double apk = a[p][k], aqk = a[q][k];
+                    a[p][k] = c * apk - s * aqk;
+                    a[q][k] = s * apk + c * aqk;
+                }
+                for (int k = 0; k < 3; ++k) {
+                    double vkp = v[k][p], vkq = v[k][q];
+                    v[k][p] = c * vkp - s * vkq;
+                    v[k][q] = s * vkp + c * vkq;
+                }
+            }
+        }
+    }
+
+    int smallest = 0;
+    for (int k = 1; k < 3; ++k) {
+        if (a[k][k] < a[smallest][smallest]) smallest = k;
+    }
+
+    int dominant = 0;
+    for (int dim = 0; dim < 3; ++dim) {
+        normal[dim] = v[dim][smallest];
+        if (fabs(normal[dim]) > fabs(normal[dominant])) dominant = dim;
+    }
+
+    double norm = sqrt(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+    if (!(norm > 0.0)) return 1;
+    double sign = normal[dominant] < 0.0 ? -1.0 : 1.0;
+    for (int dim = 0; dim < 3; ++dim) normal[dim] *= sign / norm;
+
+    return 0;
+}
+
+/*
+ * Returns the index of the grid cell containing the position. The grid lies in the plane perpendicular to `axis`.
+ */
+static inline size_t grid_cell(const vec_t position, const box_t box, const size_t grid, const int axis)
+{
+    size_t cell[2] = { 0 };
+    for (int k = 0; k < 2; ++k) {
+        int dim = (axis + 1 + k) % 3;
+        float relative = position[dim] / box[dim];
+        relative -= floorf(relative);
+        cell[k] = (size_t) (relative * grid);
+        if (cell[k] >= grid) cell[k] = grid - 1;
+    }
+
+    return cell[1] * grid + cell[0];
+}
+
+/*
+ * Assigns lipids into leaflets by comparing their heads to a local membrane midplane.
+ * Membrane atoms are binned into a grid of cells perpendicular to the normal `axis`. The midplane of a cell is the mean offset
+ * along the normal (from the membrane center) of the atoms in the cell and its 8 neighbouring cells, periodic in both directions.
+ * Cells with no atoms around use the membrane center.
+ * All steps are linear in the number of atoms and cells.
+ * Returns zero, if successful. Else returns non-zero.
+ */
+static int classify_grid(const lipid_topology_t *topology, const size_t grid, const int axis, const vec_t center, frame_t *frame)
+{
+    const size_t n_cells = grid * grid;
+    double *sums = calloc(n_cells, sizeof(double));
+    size_t *counts = calloc(n_cells, sizeof(size_t));
+    double *midplane = malloc(n_cells * sizeof(double));
+    if (sums == NULL || counts == NULL || midplane == NULL) {
+        free(sums);
+        free(counts);
+        free(midplane);
+        return 1;
+    }
+
+    for (size_t i = 0; i < topology->n_atoms; ++i) {
+        size_t cell = grid_cell(frame->coordinates[i], frame->box, grid, axis);
+        sums[cell] += minimum_image(frame->coordinates[i][axis] - center[axis], frame->box[axis]);
+        ++counts[cell];
+    }
+
+    // smooth over neighbouring cells; small grids must not visit the same cell twice
+    const int low = grid >= 3 ? -1 : 0;
+    const int high = grid >= 2 ? 1 : 0;
+    for (size_t y = 0; y < grid; ++y) {
+        for (size_t x = 0; x < grid; ++x) {
+            double sum = 0.0;
+            size_t count = 0;
+            for (int dy = low; dy <= high; ++dy) {
+                for (int dx = low; dx <= high; ++dx) {
+                    size_t neighbour = ((y + grid + dy) % grid) * grid + (x + grid + dx) % grid;
+                    sum += sums[neighbour];
+                    count += counts[neighbour];
+                }
+            }
+            midplane[y * grid + x] = count > 0 ? sum / count : 0.0;
+        }
+    }
+
+    for (size_t i = 0; i < topology->n_residues; ++i) {
+        const float *head = frame->coordinates[topology->heads[i]];
+        double offset = minimum_image(head[axis] - center[axis], frame->box[axis]);
+        frame->leaflets[i] = offset - midplane[grid_cell(head, frame->box, grid, axis)] > 0 ? 1 : 0;
+    }
+
+    free(sums);
+    free(counts);
+    free(midplane);
+    return 0;
+}
+
+/*
+ * Returns the root of the set containing `i`, halving the path on the way.
+ */
+static inline size_t cluster_root(size_t *parents, size_t i)
+{
+    while (parents[i] != i) {
+        parents[i] = parents[parents[i]];
+        i = parents[i];
+    }
+
+    return i;
+}
+
+/*
+ * Merges the sets containing `i` and `j`, attaching the smaller set to the larger one.
+ */
+static inline void cluster_union(size_t *parents, size_t *sizes, size_t i, size_t j)
+{
+    i = cluster_root(parents, i);
+    j = cluster_root(parents, j);
+    if (i == j) return;
+
+    if (sizes[i] < sizes[j]) {
+        size_t tmp = i;
+        i = j;
+        j = tmp;
+    }
+
+    parents[j] = i;
+    sizes[i] += sizes[j];
+}
+
+/*
+ * Returns the index of the cell of a cell list containing the position.
+ */
+static inline size_t cluster_cell(const float *position, const box_t box, const size_t cells[3])
+{
+    size_t cell[3] = { 0 };
+    for (int dim = 0; dim < 3; ++dim) {
+        float relative = position[dim] / box[dim];
+        relative -= floorf(relative);
+        cell[dim] = (size_t) (relative * cells[dim]);
+        if (cell[dim] >= cells[dim]) cell[dim] = cells[dim] - 1;
+    }
+
+    return (cell[2] * cells[1] + cell[1]) * cells[0] + cell[0];
+}
+
+/*
+ * Assigns lipids into leaflets by clustering their heads.
+ * Heads closer than `cutoff` (taking periodic boundary conditions into account) belong to the same cluster.
+ * Neighbouring heads are searched for using a cell list, so the clustering is linear in the number of lipids.
+ * The two largest clusters are the two leaflets. The upper (outer) leaflet is the cluster with the larger mean
+ * offset from the membrane center along the normal `axis` or, if the clusters differ more in their mean distance from the membrane center
+ * (vesicles), the cluster further from the center. Lipids in the remaining clusters are assigned to the closer leaflet.
+ * Returns zero, if successful. Else returns non-zero.
+ */
+static int classify_cluster(const lipid_topology_t *topology, const float cutoff, const int axis, const vec_t center, frame_t *frame)
+{
+    const size_t n_heads = topology->n_residues;
+    if (n_heads < 2) {
+        fprintf(stderr, "At least two lipids are required for clustering.\n");
+        return 1;
+    }
+
+    // cells must be at least as large as the cutoff; the number of cells is limited by the number of heads
+    size_t cells[3] = { 1, 1, 1 };
+    for (int dim = 0; dim < 3; ++dim) {
+        if (frame->box[dim] > cutoff) cells[dim] = (size_t) (frame->box[dim] / cutoff);
+    }
+    while (cells[0] * cells[1] * cells[2] > n_heads) {
+        int largest = 0;
+        for (int dim = 1; dim < 3; ++dim) {
+            if (cells[dim] > cells[largest]) largest = dim;
+        }
+        cells[largest] = (cells[largest] + 1) / 2;
+    }
+    const size_t n_cells = cells[0] * cells[1] * cells[2];
+
+    int return_code = 1;
+    size_t *head_cells = malloc(n_heads * sizeof(size_t));
+    size_t *cell_starts = calloc(n_cells + 1, sizeof(size_t));
+    size_t *sorted = malloc(n_heads * sizeof(size_t));
+    size_t *parents = malloc(n_heads * sizeof(size_t));
+    size_t *sizes = malloc(n_heads * sizeof(size_t));
+    if (head_cells == NULL || cell_starts == NULL || sorted == NULL || parents == NULL || sizes == NULL) {
+        fprintf(stderr, "Could not allocate memory for clustering.\n");
+        goto cluster_end;
+    }
+
+    // sort heads into cells
+    for (size_t i = 0; i < n_heads; ++i) {
+        head_cells[i] = cluster_cell(frame->coordinates[topology->heads[i]], frame->box, cells);
+        ++cell_starts[head_cells[i] + 1];
+        parents[i] = i;
+        sizes[i] = 1;
+    }
+    for (size_t c = 0; c < n_cells; ++c) cell_starts[c + 1] += cell_starts[c];
+    for (size_t i = 0; i < n_heads; ++i) {
+        // cell_starts[c] is used as the insertion point and restored afterwards
+        sorted[cell_starts[head_cells[i]]++] = i;
+    }
+    for (size_t c = n_cells; c > 0; --c) cell_starts[c] = cell_starts[c - 1];
+    cell_starts[0] = 0;
+
+    // connect heads in the same and neighbouring cells; small cell lists must not visit the same cell twice
+    const float cutoff2 = cutoff * cutoff;
+    int low[3] = { 0 }, high[3] = { 0 };
+    for (int dim = 0; dim < 3; ++dim) {
+        low[dim] = cells[dim] >= 3 ? -1 : 0;
+        high[dim] = cells[dim] >= 2 ? 1 : 0;
+    }
+
+    for (size_t cz = 0; cz < cells[2]; ++cz) {
+        for (size_t cy = 0; cy < cells[1]; ++cy) {
+            for (size_t cx = 0; cx < cells[0]; ++cx) {
+                size_t cell = (cz * cells[1] + cy) * cells[0] + cx;
+
+                for (int dz = low[2]; dz <= high[2]; ++dz) {
+                    for (int dy = low[1]; dy <= high[1]; ++dy) {
+                        for (int dx = low[0]; dx <= high[0]; ++dx) {
+                            size_t neighbour = (((cz + cells[2] + dz) % cells[2]) * cells[1] + (cy + cells[1] + dy) % cells[1]) * cells[0] + (cx + cells[0] + dx) % cells[0];
+
+                            for (size_t a = cell_starts[cell]; a < cell_starts[cell + 1]; ++a) {
+                                size_t i = sorted[a];
+                                const float *head_i = frame->coordinates[topology->heads[i]];
+
+                                for (size_t b = cell_starts[neighbour]; b < cell_starts[neighbour + 1]; ++b) {
+                                    size_t j = sorted[b];
+                                    if (j <= i) continue;
+                                    const float *head_j = frame->coordinates[topology->heads[j]];
+
+                                    float distance2 = 0.0f;
+                                    for (int dim = 0; dim < 3; ++dim) {
+                                        float d = minimum_image(head_j[dim] - head_i[dim], frame->box[dim]);
+                                        distance2 += d * d;
+                                    }
+
+                                    if (distance2 < cutoff2) cluster_union(parents, sizes, i, j);
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // find the two largest clusters
+    size_t largest[2] = { n_heads, n_heads };
+    for (size_t i = 0; i < n_heads; ++i) {
+        if (parents[i] != i) continue;
+        if (largest[0] == n_heads || sizes[i] > sizes[largest[0]]) {
+            largest[1] = largest[0];
+            largest[0] = i;
+        } else if (largest[1] == n_heads || sizes[i] > sizes[largest[1]]) {
+            largest[1] = i;
+        }
+    }
+
+    if (largest[1] == n_heads) {
+        fprintf(stderr, "All lipid heads form a single cluster. Try using a smaller clustering cutoff.\n");
+        goto cluster_end;
+    }
+
+    // offsets along the normal and distances from the membrane center; head_cells is reused to store cluster roots
+    double sums_z[2] = { 0.0 }, sums_r[2] = { 0.0 };
+    for (size_t i = 0; i < n_heads; ++i) {
+        size_t root = cluster_root(parents, i);
+        head_cells[i] = root;
+        if (root != largest[0] && root != largest[1]) continue;
+
+        const float *head = frame->coordinates[topology->heads[i]];
+        double distance2 = 0.0;
+        for (int dim = 0; dim < 3; ++dim) {
+            double d = minimum_image(head[dim] - center[dim], frame->box[dim]);
+            distance2 += d * d;
+        }
+
+        int k = root == largest[0] ? 0 : 1;
+        sums_z[k] += minimum_image(head[axis] - center[axis], frame->box[axis]);
+        sums_r[k] += sqrt(distance2);
+    }
+
+    double mean_z[2] = { 0.0 }, mean_r[2] = { 0.0 };
+    for (int k = 0; k < 2; ++k) {
+        mean_z[k] = sums_z[k] / sizes[largest[k]];
+        mean_r[k] = sums_r[k] / sizes[largest[k]];
+    }
+
+    // planar membranes are distinguished along the normal, vesicles radially
+    int radial = fabs(mean_r[0] - mean_r[1]) > fabs(mean_z[0] - mean_z[1]);
+    const double *means = radial ? mean_r : mean_z;
+    size_t upper = means[0] > means[1] ? largest[0] : largest[1];
+    double threshold = (means[0] + means[1]) / 2.0;
+
+    for (size_t i = 0; i < n_heads; ++i) {
+        size_t root = head_cells[i];
+        if (root == largest[0] || root == largest[1]) {
+            frame->leaflets[i] = root == upper ? 1 : 0;
+            continue;
+        }
+
+        const float *head = frame->coordinates[topology->heads[i]];
+        double metric = 0.0;
+        if (radial) {
+            for (int dim = 0; dim < 3; ++dim) {
+                double d = minimum_image(head[dim] - center[dim], frame->box[dim]);
+                metric += d * d;
+            }
+            metric = sqrt(metric);
+        } else {
+            metric = minimum_image(head[axis] - center[axis], frame->box[axis]);
+        }
+
+        frame->leaflets[i] = metric > threshold ? 1 : 0;
+    }
+
+    return_code = 0;
+
+    cluster_end:
+    free(head_cells);
+    free(cell_starts);
+    free(sorted);
+    free(parents);
+    free(sizes);
+    return return_code;
+}
+
+/*
+ * Detects leaflets of stacked membranes as layers of lipid heads along the normal `axis`.
+ * Heads are binned into a periodic histogram with bins at most `gap` / 2 wide, so that leaflets separated by at least `gap`
+ * are always separated by an empty bin. Each run of occupied bins is one leaflet. Leaflets are numbered along the normal,
+ * starting from the first leaflet after the largest empty region of the histogram (the lowest one, if there are several).
+ * All steps are linear in the number of lipids and bins.
+ * Returns zero, if successful. Else returns non-zero.
+ */
+static int classify_stack(const lipid_topology_t *topology, const float gap, const int axis, frame_t *frame)
+{
+    const float length = frame->box[axis];
+    // rounded up, so that no bin is wider than gap / 2
+    size_t n_bins = (size_t) ceilf(2.0f * length / gap);
+    if (n_bins < 3) {
+        fprintf(stderr, "Gap between leaflets is too large for the simulation box.\n");
+        return 1;
+    }
+
+    size_t *bins = calloc(n_bins, sizeof(size_t));
+    if (bins == NULL) {
+        fprintf(stderr, "Could not allocate memory for the histogram of lipid heads.\n");
+        return 1;
+    }
+
+    for (size_t i = 0; i < topology->n_residues; ++i) {
+        float relative = frame->coordinates[topology->heads[i]][axis] / length;
+        relative -= floorf(relative);
+        size_t bin = (size_t) (relative * n_bins);
+        if (bin >= n_bins) bin = n_bins - 1;
+        // remember the bin of each head; it is replaced by the index of the leaflet below
+        frame->leaflets[i] = bin;
+        ++bins[bin];
+    }
+
+    // find the largest empty region, taking periodicity into account
+    size_t best_length = 0, run = 0;
+    for (size_t k = 0; k < 2 * n_bins; ++k) {
+        if (bins[k % n_bins] == 0) {
+            ++run;
+            continue;
+        }
+
+        if (run < n_bins && run > best_length) best_length = run;
+        run = 0;
+    }
+
+    // empty regions differing only by binning are equally large; the one closest to the bottom of the box is preferred
+    size_t start = n_bins;
+    run = 0;
+    for (size_t k = 0; k < 2 * n_bins && best_length > 0; ++k) {
+        if (bins[k % n_bins] == 0) {
+            ++run;
+            continue;
+        }
+
+        if (run > 0 && run < n_bins && run + 1 >= best_length && k % n_bins < start) start = k % n_bins;
+        run = 0;
+    }
+
+    if (start == n_bins) {
+        fprintf(stderr, "Could not find any gap between leaflets along the membrane normal. Try using a smaller gap.\n");
+        free(bins);
+        return 1;
+    }
+
+    // label runs of occupied bins; bins are reused to store the leaflet indices
+    size_t n_leaflets = 0;
+    int previous_empty = 1;
+    for (size_t k = 0; k < n_bins; ++k) {
+        size_t bin = (start + k) % n_bins;
+        if (bins[bin] == 0) {
+            previous_empty = 1;
+            continue;
+        }
+
+        if (previous_empty) ++n_leaflets;
+        previous_empty = 0;
+        bins[bin] = n_leaflets - 1;
+    }
+
+    for (size_t i = 0; i < topology->n_residues; ++i) {
+        frame->leaflets[i] = bins[frame->leaflets[i]];
+    }
+
+    frame->n_leaflets = n_leaflets;
+    free(bins);
+    return 0;
+}
+
+/*
+ * Assigns each lipid into a membrane leaflet based on the coordinates in the frame.
+ * Returns zero, if successful. Else returns non-zero.
+ */
+int classify_lipids(const lipid_topology_t *topology, const classification_t *classification, frame_t *frame)
+{
+    // calculate membrane center
+    double start = monotonic_seconds();
+    vec_t center = {0.0};
+    if (membrane_center(frame, topology->n_atoms, topology->masses, classification->n_threads, center) != 0) {
+        fprintf(stderr, "Could not calculate center of %s for membrane lipids.\n", topology->masses == NULL ? "geometry" : "mass");
+        return 1;
+    }
+
+    // estimate membrane normal; grid and cluster methods use the coordinate axis closest to it
+    double normal[3] = { 0.0 };
+    int axis = classification->normal;
+    if (axis == NORMAL_AUTO) {
+        if (membrane_normal(frame, topology->n_atoms, center, normal) != 0) {
+            fprintf(stderr, "Could not estimate membrane normal.\n");
+            return 1;
+        }
+
+        axis = 0;
+        for (int dim = 1; dim < 3; ++dim) {
+            if (fabs(normal[dim]) > fabs(normal[axis])) axis = dim;
+        }
+    }
+    timings_add(&frame->timings, PHASE_CENTER, start, topology->n_atoms);
+
+    // assign lipids into leaflets
+    // 1 -> upper, 0 -> lower
+    start = monotonic_seconds();
+    frame->n_leaflets = 2;
+    if (classification->method == METHOD_STACK) {
+        if (classify_stack(topology, classification->gap, axis, frame) != 0) return 1;
+        timings_add(&frame->timings, PHASE_CLASSIFY, start, topology->n_residues);
+        return 0;
+    }
+
+    if (classification->method == METHOD_GRID) {
+        if (classify_grid(topology, classification->grid, axis, center, frame) != 0) {
+            fprintf(stderr, "Could not allocate memory for the membrane grid.\n");
+            return 1;
+        }
+        timings_add(&frame->timings, PHASE_CLASSIFY, start, topology->n_atoms);
+        return 0;
+    }
+
+    if (classification->method == METHOD_CLUSTER) {
+        if (classify_cluster(topology, classification->cutoff, axis, center, frame) != 0) return 1;
+        timings_add(&frame->timings, PHASE_CLASSIFY, start, topology->n_residues);
+        return 0;
+    }
+
+    if (classification->normal == NORMAL_AUTO) {
+        for (size_t i = 0; i < topology->n_residues; ++i) {
+            const float *head = frame->coordinates[topology->heads[i]];
+            double offset = 0.0;
+            for (int dim = 0; dim < 3; ++dim) {
+                offset += minimum_image(head[dim] - center[dim], frame->box[dim]) * normal[dim];
+            }
+            frame->leaflets[i] = offset > 0 ? 1 : 0;
+        }
+    } else {
+        for (size_t i = 0; i < topology->n_residues; ++i) {
+            frame->leaflets[i] = distance1D(frame->coordinates[topology->heads[i]], center, (dimension_t) axis, frame->box) > 0 ? 1 : 0;
+        }
+    }
+    timings_add(&frame->timings, PHASE_CLASSIFY, start, 0);
+
+    return 0;
+}
+
+/*! @brief Creates ndx groups for lipids distinguishing between `n_leaflets` membrane leaflets. Returns the number of ndx groups or 0 if no groups were created. */
+size_t create_groups(
+        const lipid_topology_t *topology,
+        const atom_selection_t *membrane,
+        const size_t *leaflets,
+        const size_t n_leaflets,
+        atom_selection_t ***ndx_groups) 
+{
+    // first pass: count atoms of each ndx group
+    size_t n_groups = topology->n_resnames * n_leaflets;
+    size_t *group_sizes = calloc(n_groups, sizeof(size_t));
+    *ndx_groups = calloc(n_groups, sizeof(atom_selection_t *));
+    if (group_sizes == NULL || *ndx_groups == NULL) {
+        fprintf(stderr, "Could not allocate memory for ndx groups.\n");
+        free(group_sizes);
+        free(*ndx_groups);
+        *ndx_groups = NULL;
+        return 0;
+    }
+
+    for (size_t i = 0; i < topology->n_residues; ++i) {
+        group_sizes[n_leaflets * topology->resnames[i] + leaflets[i]] += topology->residues[i].length;
+    }
+
+    // second pass: fill exactly sized ndx groups
+    for (size_t i = 0; i < n_groups; ++i) {
+        (*ndx_groups)[i] = selection_create(group_sizes[i]);
+        if ((*ndx_groups)[i] == NULL) {
+            fprintf(stderr, "Could not allocate memory for ndx groups.\n");
+            free(group_sizes);
+            destroy_selections(*ndx_groups, i);
+            *ndx_groups = NULL;
+            return 0;
+        }
+    }
+
+    for (size_t i = 0; i < topology->n_residues; ++i) {
+        atom_selection_t *group = (*ndx_groups)[n_leaflets * topology->resnames[i] + leaflets[i]];
+        memcpy(&group->atoms[group->n_atoms], &membrane->atoms[topology->residues[i].start], topology->residues[i].length * sizeof(atom_t *));
+        group->n_atoms += topology->residues[i].length;
+    }
+
+    free(group_sizes);
+    return n_groups;
+}
+
+/*
+ * Writes the lipids_leaflets ndx groups followed by the groups of whole leaflets.
+ * Two leaflets are named lower and upper, unless `numbered` is non-zero. Otherwise, the leaflets are named L0, L1, ...
+ * `suffix` is appended to the name of each ndx group.
+ * Returns zero, if successful. Else returns non-zero.
+ */
+int write_groups(
+        ndx_writer_t *writer,
+        const list_t *residue_names,
+        atom_selection_t **lipids_leaflets,
+        const size_t n_groups,
+        const size_t n_leaflets,
+        const int numbered,
+        const char *suffix,
+        const int empty)
+{
+    // whole leaflet groups are written directly from the individual leaflet groups
+    size_t n_resnames = n_groups / n_leaflets;
+    atom_selection_t **parts = malloc(n_groups * sizeof(atom_selection_t *));
+    size_t *n_leaflet_atoms = calloc(n_leaflets, sizeof(size_t));
+    if (parts == NULL || n_leaflet_atoms == NULL) {
+        fprintf(stderr, "Could not allocate memory for leaflet groups.\n");
+        free(parts);
+        free(n_leaflet_atoms);
+        return 1;
+    }
+
+    const int bilayer = n_leaflets == 2 && !numbered;
+    char leaflet_name[32] = "";
+    char group_name[100] = "";
+    for (size_t i = 0; i < n_groups; ++i) {
+        size_t leaflet = i % n_leaflets;
+        parts[leaflet * n_resnames + i / n_leaflets] = lipids_leaflets[i];
+        n_leaflet_atoms[leaflet] += lipids_leaflets[i]->n_atoms;
+
+        if (!empty && lipids_leaflets[i]->n_atoms == 0) continue;
+
+        char *resname = list_get(residue_names, i / n_leaflets);
+        if (resname == NULL) {
+            fprintf(stderr, "Internal error. Reaching element of index %ld in a list_t of length %ld", i / n_leaflets, residue_names->n_items);
+            fprintf(stderr, "This should never happen.\n");
+            free(parts);
+            free(n_leaflet_atoms);
+            return 1;
+        }
+
+        if (bilayer) snprintf(leaflet_name, sizeof(leaflet_name), "%s", leaflet == 0 ? "lower" : "upper");
+        else snprintf(leaflet_name, sizeof(leaflet_name), "L%zu", leaflet);
+        snprintf(group_name, sizeof(group_name), "%s_%s%s", resname, leaflet_name, suffix);
+        write_ndx_group(writer, group_name, lipids_leaflets[i]);
+    }
+
+    for (size_t leaflet = 0; leaflet < n_leaflets; ++leaflet) {
+        if (!empty && n_leaflet_atoms[leaflet] == 0) continue;
+
+        if (bilayer) snprintf(group_name, sizeof(group_name), "%s%s", leaflet == 0 ? "Lower" : "Upper", suffix);
+        else snprintf(group_name, sizeof(group_name), "L%zu%s", leaflet, suffix);
+        write_ndx_group_parts(writer, group_name, &parts[leaflet * n_resnames], n_resnames);
+    }
+
+    free(parts);
+    free(n_leaflet_atoms);
+    return 0;
+}
+
+/*
+ * Classifies lipids in the frame and writes the resulting ndx groups.
+ * Returns zero, if successful. Else returns non-zero.
+ */
+int process_frame(
+        ndx_writer_t *writer,
+        const lipid_topology_t *topology,
+        const classification_t *classification,
+        const atom_selection_t *membrane,
+        const list_t *residue_names,
+        frame_t *frame,
+        const char *suffix,
+        const int empty)
+{
+    if (classify_lipids(topology, classification, frame) != 0) return 1;
+
+    double start = monotonic_seconds();
+    atom_selection_t **lipids_leaflets = NULL;
+    size_t n_groups = create_groups(topology, membrane, frame->leaflets, frame->n_leaflets, &lipids_leaflets);
+    if (n_groups == 0) return 1;
+    timings_add(&frame->timings, PHASE_CLASSIFY, start, topology->n_atoms);
+
+    start = monotonic_seconds();
+    int return_code = write_groups(writer, residue_names, lipids_leaflets, n_groups, frame->n_leaflets, classification->method == METHOD_STACK, suffix, empty);
+    timings_add(&frame->timings, PHASE_WRITE, start, topology->n_atoms);
+
+    destroy_selections(lipids_leaflets, n_groups);
+    return return_code;
+}
+
+/*
+ * Source of frames processed one after another: frames of a trajectory or coordinates of gro files in batch mode.
+ */
+typedef struct frame_source {
+    int (*read)(void *data, system_t *system);  // returns 0 if a frame has been read, 1 if there are no more frames and -1 on error
+    void *data;
+    list_t *outputs;    // if not NULL, ndx groups of frame i are written into file i instead of the common output
+    int replace;        // replace the per-frame output files instead of appending to them
+} frame_source_t;
+
+/*
+ * Writes the suffix of ndx group names for the frame with the given index.
+ * Frames written into separate output files do not need any suffix.
+ */
+static void frame_suffix(const frame_source_t *source, const size_t index, char *suffix, const size_t size)
+{
+    if (source->outputs != NULL) suffix[0] = '\0';
+    else snprintf(suffix, size, "_frame%zu", index);
+}
+
+/*
+ * Returns the writer for ndx groups of the frame with the given index: either the common writer or a newly opened per-frame writer.
+ * Returns NULL if the per-frame output file could not be opened.
+ */
+static ndx_writer_t *frame_writer(const frame_source_t *source, ndx_writer_t *writer, const size_t index)
+{
+    if (source->outputs == NULL) return writer;
+
+    const char *filename = list_get(source->outputs, index);
+    ndx_writer_t *output = ndx_writer_open(filename, source->replace);
+    if (output == NULL) fprintf(stderr, "The output ndx file %s could not be opened.\n", filename);
+    return output;
+}
+
+/*
+ * Finishes writing ndx groups of a frame: commits them to the common writer or closes the per-frame writer.
+ * If the frame `failed`, nothing is committed and the per-frame writer is aborted.
+ * Returns zero, if successful. Else returns non-zero.
+ */
+static int frame_writer_finish(ndx_writer_t *output, ndx_writer_t *writer, const int failed)
+{
+    if (output == writer) return failed ? 1 : ndx_writer_commit(writer);
+
+    if (failed) {
+        ndx_writer_abort(output);
+        return 1;
+    }
+    return ndx_writer_destroy(output);
+}
+
+#define SLOT_FREE 0
+#define SLOT_LOADED 1
+#define SLOT_DONE 2
+
+/*
+ * State shared by the threads processing trajectory frames in parallel.
+ * Frame `i` is always placed into slot `i % n_slots`. Worker threads classify the frames in any order,
+ * while the output thread writes them out strictly in the order of the frames.
+ */
+typedef struct frame_pipeline {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    size_t n_slots;
+    frame_t **slots;
+    int *states;
+    size_t n_loaded;
+    size_t n_claimed;
+    size_t n_written;
+    int finished;
+    int failed;
+    ndx_writer_t *writer;
+    const frame_source_t *source;
+    timings_t *timings;
+    const lipid_topology_t *topology;
+    const classification_t *classification;
+    const atom_selection_t *membrane;
+    const list_t *residue_names;
+    int empty;
+} frame_pipeline_t;
+
+static void *pipeline_worker(void *arg)
+{
+    frame_pipeline_t *pipeline = arg;
+
+    pthread_mutex_lock(&pipeline->lock);
+    while (1) {
+        while (!pipeline->failed && !pipeline->finished && pipeline->n_claimed == pipeline->n_loaded) {
+            pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+        }
+        if (pipeline->failed || pipeline->n_claimed == pipeline->n_loaded) break;
+
+        size_t slot = pipeline->n_claimed++ % pipeline->n_slots;
+        pthread_mutex_unlock(&pipeline->lock);
+
+        frame_t *frame = pipeline->slots[slot];
+        char suffix[32] = "";
+        frame_suffix(pipeline->source, frame->index, suffix, sizeof(suffix));
+        frame->output->used = 0;
+        int error = process_frame(frame->output, pipeline->topology, pipeline->classification, pipeline->membrane, pipeline->residue_names, frame, suffix, pipeline->empty);
+        if (error) fprintf(stderr, "Failed to create ndx groups for frame %zu.\n", frame->index);
+
+        pthread_mutex_lock(&pipeline->lock);
+        if (error) pipeline->failed = 1;
+        else pipeline->states[slot] = SLOT_DONE;
+        pthread_cond_broadcast(&pipeline->changed);
+    }
+    pthread_mutex_unlock(&pipeline->lock);
+
+    return NULL;
+}
+
+static void *pipeline_output(void *arg)
+{
+    frame_pipeline_t *pipeline = arg;
+
+    pthread_mutex_lock(&pipeline->lock);
+    while (1) {
+        while (!pipeline->failed &&
+                (pipeline->n_written == pipeline->n_loaded ? !pipeline->finished : pipeline->states[pipeline->n_written % pipeline->n_slots] != SLOT_DONE)) {
+            pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+        }
+        if (pipeline->failed || pipeline->n_written == pipeline->n_loaded) break;
+
+        size_t slot = pipeline->n_written % pipeline->n_slots;
+        pthread_mutex_unlock(&pipeline->lock);
+
+        ndx_writer_t *output = pipeline->slots[slot]->output;
+        double start = monotonic_seconds();
+        ndx_writer_t *target = frame_writer(pipeline->source, pipeline->writer, pipeline->slots[slot]->index);
+        int error = output->error || target == NULL;
+        if (target != NULL) {
+            ndx_writer_put(target, output->buffer, output->used);
+            error |= frame_writer_finish(target, pipeline->writer, error);
+        }
+
+        pthread_mutex_lock(&pipeline->lock);
+        timings_add(pipeline->timings, PHASE_WRITE, start, 0);
+        timings_merge(pipeline->timings, &pipeline->slots[slot]->timings);
+        if (error) pipeline->failed = 1;
+        pipeline->states[slot] = SLOT_FREE;
+        ++pipeline->n_written;
+        pthread_cond_broadcast(&pipeline->changed);
+    }
+    pthread_mutex_unlock(&pipeline->lock);
+
+    return NULL;
+}
+
+/*
+ * Reads frames from the source and classifies them using `n_threads` worker threads.
+ * Frames are read sequentially by the calling thread, classified in parallel and written out in their original order.
+ * Returns zero, if successful. Else returns non-zero.
+ */
+int process_frames_parallel(
+        ndx_writer_t *writer,
+        const frame_source_t *source,
+        const lipid_topology_t *topology,
+        const classification_t *classification,
+        system_t *system,
+        const atom_selection_t *membrane,
+        const list_t *residue_names,
+        const size_t n_threads,
+        const int empty,
+        timings_t *timings)
+{
+    frame_pipeline_t pipeline = { 0 };
+    pipeline.n_slots = 2 * n_threads;
+    pipeline.writer = writer;
+    pipeline.source = source;
+    pipeline.timings = timings;
+    pipeline.topology = topology;
+    pipeline.classification = classification;
+    pipeline.membrane = membrane;
+    pipeline.residue_names = residue_names;
+    pipeline.empty = empty;
+
+    pipeline.slots = calloc(pipeline.n_slots, sizeof(frame_t *));
+    pipeline.states = calloc(pipeline.n_slots, sizeof(int));
+    pthread_t *workers = calloc(n_threads, sizeof(pthread_t));
+    int return_code = 1;
+    if (pipeline.slots == NULL || pipeline.states == NULL || workers == NULL) {
+        fprintf(stderr, "Could not allocate memory for trajectory frames.\n");
+        goto parallel_end;
+    }
+
+    for (size_t i = 0; i < pipeline.n_slots; ++i) {
+        if ((pipeline.slots[i] = frame_create(topology, 1)) == NULL) {
+            fprintf(stderr, "Could not allocate memory for trajectory frames.\n");
+            goto parallel_end;
+        }
+    }
+
+    pthread_mutex_init(&pipeline.lock, NULL);
+    pthread_cond_init(&pipeline.changed, NULL);
+
+    size_t n_started = 0;
+    pthread_t output_thread;
+    int output_started = pthread_create(&output_thread, NULL, pipeline_output, &pipeline) == 0;
+    if (output_started) {
+        for (; n_started < n_threads; ++n_started) {
+            if (pthread_create(&workers[n_started], NULL, pipeline_worker, &pipeline) != 0) break;
+        }
+    }
+
+    if (!output_started || n_started == 0) {
+        fprintf(stderr, "Could not start threads.\n");
+        pipeline.failed = 1;
+    }
+
+    // read frames and hand them over to the workers
+    double start = monotonic_seconds();
+    int status = 0;
+    while (!pipeline.failed && (status = source->read(source->data, system)) == 0) {
+        size_t slot = pipeline.n_loaded % pipeline.n_slots;
+
+        pthread_mutex_lock(&pipeline.lock);
+        while (!pipeline.failed && pipeline.states[slot] != SLOT_FREE) {
+            pthread_cond_wait(&pipeline.changed, &pipeline.lock);
+        }
+        pthread_mutex_unlock(&pipeline.lock);
+        if (pipeline.failed) break;
+
+        frame_load(pipeline.slots[slot], topology, system, pipeline.n_loaded);
+
+        pthread_mutex_lock(&pipeline.lock);
+        timings_add(timings, PHASE_READ_FRAMES, start, system->n_atoms);
+        pipeline.states[slot] = SLOT_LOADED;
+        ++pipeline.n_loaded;
+        pthread_cond_broadcast(&pipeline.changed);
+        pthread_mutex_unlock(&pipeline.lock);
+        start = monotonic_seconds();
+    }
+
+    pthread_mutex_lock(&pipeline.lock);
+    if (status < 0) pipeline.failed = 1;
+    pipeline.finished = 1;
+    pthread_cond_broadcast(&pipeline.changed);
+    pthread_mutex_unlock(&pipeline.lock);
+
+    for (size_t i = 0; i < n_started; ++i) pthread_join(workers[i], NULL);
+    if (output_started) pthread_join(output_thread, NULL);
+
+    pthread_cond_destroy(&pipeline.changed);
+    pthread_mutex_destroy(&pipeline.lock);
+
+    return_code = pipeline.failed;
+
+    parallel_end:
+    if (pipeline.slots != NULL) {
+        for (size_t i = 0; i < pipeline.n_slots; ++i) frame_destroy(pipeline.slots[i]);
+    }
+    free(pipeline.slots);
+    free(pipeline.states);
+    free(workers);
+    return return_code;
+}
+
+/*
+ * Reads all frames from the source and writes ndx groups for each of them.
+ * Frames are processed using `n_threads` threads. The names of the ndx groups are suffixed by the index of the frame
+ * unless each frame is written into a separate file.
+ * Returns zero, if successful. Else returns non-zero.
+ */
+int process_frames(
+        ndx_writer_t *writer,
+        const frame_source_t *source,
+        const lipid_topology_t *topology,
+        const classification_t *classification,
+        system_t *system,
+        const atom_selection_t *membrane,
+        const list_t *residue_names,
+        const size_t n_threads,
+        const int empty,
+        timings_t *timings)
+{
+    if (n_threads > 1) return process_frames_parallel(writer, source, topology, classification, system, membrane, residue_names, n_threads, empty, timings);
+
+    frame_t *frame = frame_create(topology, 0);
+    if (frame == NULL) {
+        fprintf(stderr, "Could not allocate memory for trajectory frames.\n");
+        return 1;
+    }
+
+    char suffix[32] = "";
+    size_t index = 0;
+    int status = 0;
+    double start = monotonic_seconds();
+    while ((status = source->read(source->data, system)) == 0) {
+        frame_load(frame, topology, system, index);
+        timings_add(timings, PHASE_READ_FRAMES, start, system->n_atoms);
+
+        frame_suffix(source, index, suffix, sizeof(suffix));
+        ndx_writer_t *output = frame_writer(source, writer, index);
+        int error = output == NULL || process_frame(output, topology, classification, membrane, residue_names, frame, suffix, empty) != 0;
+        start = monotonic_seconds();
+        if (output != NULL) error |= frame_writer_finish(output, writer, error);
+        timings_add(&frame->timings, PHASE_WRITE, start, 0);
+        timings_merge(timings, &frame->timings);
+        if (error) {
+            fprintf(stderr, "Failed to create ndx groups for frame %zu.\n", index);
+            frame_destroy(frame);
+            return 1;
+        }
+        ++index;
+        start = monotonic_seconds();
+    }
+
+    frame_destroy(frame);
+    return status < 0;
+}
+
+/*
+ * Magic numbers of xtc and trr frames.
+ */
+#define XTC_MAGIC 1995
+#define XTC_MAGIC_LARGE 2023
+#define TRR_MAGIC 1993
+
+/*
+ * Reads `n` big-endian (XDR) 32-bit integers from the stream.
+ * Returns zero, if successful. Else returns non-zero.
+ */
+static int read_xdr_ints(FILE *stream, uint32_t *values, const size_t n)
+{
+    unsigned char bytes[4] = { 0 };
+    for (size_t i = 0; i < n; ++i) {
+        if (fread(bytes, 1, 4, stream) != 4) return 1;
+        values[i] = (uint32_t) bytes[0] << 24 | (uint32_t) bytes[1] << 16 | (uint32_t) bytes[2] << 8 | (uint32_t) bytes[3];
+    }
+
+    return 0;
+}
+
+/*
+ * Skips `size` bytes of the stream, checking that all of them are present.
+ * Returns zero, if successful. Else returns non-zero.
+ */
+static int skip_bytes(FILE *stream, const uint64_t size)
+{
+    if (size == 0) return 0;
+    if (size - 1 > (uint64_t) INT64_MAX || fseeko(stream, (off_t) (size - 1), SEEK_CUR) != 0) return 1;
+    return fgetc(stream) == EOF;
+}
+
+/*
+ * Skips one frame of an xtc trajectory.
+ * Returns 0 if a complete frame has been skipped, 1 at the end of the file and -1 if the frame is incomplete or invalid.
+ */
+static int skip_xtc_frame(FILE *stream)
+{
+    int c = fgetc(stream);
+    if (c == EOF) return 1;
+    ungetc(c, stream);
+
+    // magic, number of atoms, step, time, box, number of atoms
+    uint32_t header[14] = { 0 };
+    if (read_xdr_ints(stream, header, 14) != 0 || (header[0] != XTC_MAGIC && header[0] != XTC_MAGIC_LARGE)) return -1;
+
+    // up to 9 atoms are stored uncompressed
+    if (header[13] <= 9) return skip_bytes(stream, 12 * (uint64_t) header[13]) ? -1 : 0;
+
+    // precision, minimal and maximal integer coordinates, smallidx, size of the compressed coordinates
+    uint32_t compression[10] = { 0 };
+    size_t n_ints = header[0] == XTC_MAGIC_LARGE ? 10 : 9;
+    if (read_xdr_ints(stream, compression, n_ints) != 0) return -1;
+
+    uint64_t size = compression[8];
+    if (header[0] == XTC_MAGIC_LARGE) size = size << 32 | compression[9];
+
+    return skip_bytes(stream, (size + 3) / 4 * 4) ? -1 : 0;
+}
+
+/*
+ * Skips one frame of a trr trajectory.
+ * Returns 0 if a complete frame has been skipped, 1 at the end of the file and -1 if the frame is incomplete or invalid.
+ */
+static int skip_trr_frame(FILE *stream)
+{
+    int c = fgetc(stream);
+    if (c == EOF) return 1;
+    ungetc(c, stream);
+
+    // magic, length of the version string (including and excluding the terminating character), the version string
+    uint32_t magic[3] = { 0 };
+    if (read_xdr_ints(stream, magic, 3) != 0 || magic[0] != TRR_MAGIC || skip_bytes(stream, ((uint64_t) magic[2] + 3) / 4 * 4)) return -1;
+
+    // sizes of ir, e, box, vir, pres, top, sym, x, v, f blocks, number of atoms, step, nre
+    uint32_t sizes[13] = { 0 };
+    if (read_xdr_ints(stream, sizes, 13) != 0) return -1;
+
+    // time and lambda are stored in the precision of the coordinates
+    uint64_t natoms = sizes[10];
+    int double_precision = sizes[2] != 0 ? sizes[2] == 9 * sizeof(double) :
+                           sizes[7] != 0 ? sizes[7] == natoms * 3 * sizeof(double) :
+                           sizes[8] != 0 ? sizes[8] == natoms * 3 * sizeof(double) :
+                           sizes[9] == natoms * 3 * sizeof(double);
+
+    uint64_t size = 2 * (double_precision ? sizeof(double) : sizeof(float));
+    for (size_t i = 0; i < 10; ++i) size += sizes[i];
+
+    return skip_bytes(stream, size) ? -1 : 0;
+}
+
+/*
+ * Open xtc or trr trajectory.
+ * Frame boundaries are followed in a separate stream, so that the end of the trajectory can be told apart
+ * from a truncated or corrupted frame (the xdrfile readers fail the same way in both cases).
+ */
+typedef struct trajectory {
+    XDRFILE *file;
+    int (*read_step)(XDRFILE *, system_t *);
+    FILE *frames;
+    int (*skip_frame)(FILE *);
+    const char *path;
+    size_t n_frames;
+} trajectory_t;
+
+static int trajectory_read(void *data, system_t *system)
+{
+    trajectory_t *trajectory = data;
+    int boundary = trajectory->skip_frame(trajectory->frames);
+    int status = trajectory->read_step(trajectory->file, system);
+
+    if (status == 0 && boundary == 0) {
+        ++trajectory->n_frames;
+        return 0;
+    }
+
+    if (status != 0 && boundary == 1) return 1;
+
+    fprintf(stderr, "Could not read frame %zu of trajectory %s. The file is truncated or corrupted.\n", trajectory->n_frames, trajectory->path);
+    return -1;
+}
+
+/*
+ * Reads all frames of an xtc or trr trajectory and writes ndx groups for each of them.
+ * The names of the ndx groups are suffixed by the index of the frame.
+ * Returns zero, if successful. Else returns non-zero.
+ */
+int process_trajectory(
+        ndx_writer_t *writer,
+        const char *traj_file,
+        const lipid_topology_t *topology,
+        const classification_t *classification,
+        system_t *system,
+        const atom_selection_t *membrane,
+        const list_t *residue_names,
+        const size_t n_threads,
+        const int empty,
+        timings_t *timings)
+{
+    trajectory_t trajectory = { NULL, NULL, NULL, NULL, traj_file, 0 };
+    if (ends_with(traj_file, ".xtc")) {
+        if (validate_xtc(traj_file, (int) system->n_atoms) != 0) {
+            fprintf(stderr, "Number of atoms in %s does not match the gro file.\n", traj_file);
+            return 1;
+        }
+        trajectory.read_step = read_xtc_step;
+        trajectory.skip_frame = skip_xtc_frame;
+    } else if (ends_with(traj_file, ".trr")) {
+        if (validate_trr(traj_file, (int) system->n_atoms) != 0) {
+            fprintf(stderr, "Number of atoms in %s does not match the gro file.\n", traj_file);
+            return 1;
+        }
+        trajectory.read_step = read_trr_step;
+        trajectory.skip_frame = skip_trr_frame;
+    } else {
+        fprintf(stderr, "Unknown trajectory format of file %s. Supported formats are xtc and trr.\n", traj_file);
+        return 1;
+    }
+
+    trajectory.file = xdrfile_open(traj_file, "r");
+    trajectory.frames = fopen(traj_file, "rb");
+    if (trajectory.file == NULL || trajectory.frames == NULL) {
+        fprintf(stderr, "File %s could not be read as a trajectory.\n", traj_file);
+        if (trajectory.file != NULL) xdrfile_close(trajectory.file);
+        if (trajectory.frames != NULL) fclose(trajectory.frames);
+        return 1;
+    }
+
+    frame_source_t source = { trajectory_read, &trajectory, NULL, 0 };
+    int return_code = process_frames(writer, &source, topology, classification, system, membrane, residue_names, n_threads, empty, timings);
+
+    xdrfile_close(trajectory.file);
+    fclose(trajectory.frames);
+    return return_code;
+}
+
+/*
+ * Gro files processed in batch mode.
+ */
+typedef struct batch {
+    list_t *files;
+    size_t next;
+    size_t n_threads;
+} batch_t;
+
+/*
+ * Reads coordinates and box of the next gro file of the batch into the system. The topology of the system is not changed.
+ * Returns 0 if the coordinates have been read, 1 if there are no more files and -1 if the file could not be read.
+ */
+static int batch_read(void *data, system_t *system)
+{
+    batch_t *batch = data;
+    if (batch->next >= batch->files->n_items) return 1;
+
+    const char *filename = list_get(batch->files, batch->next++);
+    system_t *snapshot = read_gro(filename, batch->n_threads);
+    if (snapshot == NULL) return -1;
+
+    if (snapshot->n_atoms != system->n_atoms) {
+        fprintf(stderr, "Number of atoms in %s does not match the gro file.\n", filename);
+        free(snapshot);
+        return -1;
+    }
+
+    memcpy(system->box, snapshot->box, sizeof(box_t));
+    for (size_t i = 0; i < system->n_atoms; ++i) {
+        memcpy(system->atoms[i].position, snapshot->atoms[i].position, sizeof(vec_t));
+    }
+
+    free(snapshot);
+    return 0;
+}
+
+/*
+ * Expands the batch patterns using glob(3) and appends the matching files to `files` (sorted for each pattern).
+ * Lines of the batch list file (if not NULL) are appended as well.
+ * Returns zero, if successful. Else returns non-zero.
+ */
+int batch_collect(list_t *files, const list_t *patterns, const char *list_file)
+{
+    for (size_t i = 0; i < patterns->n_items; ++i) {
+        const char *pattern = list_get(patterns, i);
+        glob_t matches;
+        if (glob(pattern, 0, NULL, &matches) != 0) {
+            fprintf(stderr, "No files match the pattern '%s'.\n", pattern);
+            globfree(&matches);
+            return 1;
+        }
+
+        for (size_t j = 0; j < matches.gl_pathc; ++j) list_append(files, matches.gl_pathv[j]);
+        globfree(&matches);
+    }
+
+    if (list_file == NULL) return 0;
+
+    FILE *list = fopen(list_file, "r");
+    if (list == NULL) {
+        fprintf(stderr, "File %s could not be read.\n", list_file);
+        return 1;
+    }
+
+    char line[4096] = "";
+    while (fgets(line, sizeof(line), list) != NULL) {
+        size_t length = strlen(line);
+        while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r' || line[length - 1] == ' ')) line[--length] = '\0';
+        if (length > 0) list_append(files, line);
+    }
+
+    fclose(list);
+    return 0;
+}
+
+/*
+ * Derives the name of the per-file output from the name of a gro file by replacing the extension with .ndx.
+ * A compression extension is kept, so `frame.gro.gz` is written into `frame.ndx.gz`.
+ * Returns zero, if successful. Else returns non-zero.
+ */
+static int batch_output_name(const char *gro_file, char *output, const size_t size)
+{
+    const char *compression = ends_with(gro_file, ".gz") ? ".gz" : ends_with(gro_file, ".zst") ? ".zst" : "";
+    size_t length = strlen(gro_file) - strlen(compression);
+    if (length >= 4 && strncmp(gro_file + length - 4, ".gro", 4) == 0) length -= 4;
+
+    return (size_t) snprintf(output, size, "%.*s.ndx%s", (int) length, gro_file, compression) >= size;
+}
+
+/*
+ * Assigns lipids of each gro file of the batch into leaflets. The topology and the selections are reused for all files;
+ * only the coordinates and the box are read from each file.
+ * If `split` is non-zero, ndx groups of each gro file are written into a separate ndx file (see batch_output_name).
+ * Otherwise, all ndx groups are written into the common output and their names are suffixed by the index of the file.
+ * Returns zero, if successful. Else returns non-zero.
+ */
+int process_batch(
+        ndx_writer_t *writer,
+        list_t *files,
+        const int split,
+        const int replace,
+        const lipid_topology_t *topology,
+        const classification_t *classification,
+        system_t *system,
+        const atom_selection_t *membrane,
+        const list_t *residue_names,
+        const size_t n_threads,
+        const int empty,
+        timings_t *timings)
+{
+    list_t *outputs = NULL;
+    if (split) {
+        outputs = list_create();
+        if (outputs == NULL) {
+            fprintf(stderr, "Could not allocate memory for the names of output files.\n");
+            return 1;
+        }
+
+        char output[4096] = "";
+        for (size_t i = 0; i < files->n_items; ++i) {
+            if (batch_output_name(list_get(files, i), output, sizeof(output)) != 0) {
+                fprintf(stderr, "Name of the output file for %s is too long.\n", list_get(files, i));
+                list_destroy(outputs);
+                return 1;
+            }
+            list_append(outputs, output);
+        }
+    }
+
+    batch_t batch = { files, 0, n_threads };
+    frame_source_t source = { batch_read, &batch, outputs, replace };
+    int return_code = process_frames(writer, &source, topology, classification, system, membrane, residue_names, n_threads, empty, timings);
+
+    if (outputs != NULL) list_destroy(outputs);
+    return return_code;
+}
+
+int main(int argc, char **argv)
+{
+    // get arguments
+    char *gro_file = NULL;
+    char *ndx_file = "index.ndx";
+    char *traj_file = NULL;
+    char *output_file = NULL;
+    char *selected = "Membrane";
+    char *phosphate = "name PO4";
+    int empty = 0;
+    size_t n_threads = 1;
+    int report_timings = 0;
+    int ndx_cache = 0;
+    int replace = 0;
+    char *batch_list = NULL;
+    int split = 0;
+    char *topology_cache = NULL;
+    classification_t classification = { METHOD_GLOBAL, z, 0, 0.0f, 0.0f, 1, 0, NULL };
+
+    int return_code = 0;
+
+    list_t *batch_patterns = list_create();
+    if (get_arguments(argc, argv, &gro_file, &ndx_file, &traj_file, &output_file, &selected, &phosphate, &empty, &n_threads, &report_timings, &ndx_cache, &replace,
+            batch_patterns, &batch_list, &split, &topology_cache, &classification) != 0) {
+        print_usage(argv[0]);
+        list_destroy(batch_patterns);
+        return 1;
+    }
+
+    // collect gro files processed in batch mode; the topology is read from the first of them unless -c is supplied
+    list_t *batch_files = NULL;
+    if (batch_patterns->n_items > 0 || batch_list != NULL) {
+        batch_files = list_create();
+        int error = batch_collect(batch_files, batch_patterns, batch_list);
+        if (error || batch_files->n_items == 0) {
+            if (!error) fprintf(stderr, "No gro files to process in batch mode.\n");
+            list_destroy(batch_files);
+            list_destroy(batch_patterns);
+            return 1;
+        }
+        if (gro_file == NULL) gro_file = list_get(batch_files, 0);
+    }
+    list_destroy(batch_patterns);
+
+    timings_t timings = { 0 };
+    double program_start = monotonic_seconds();
+    
+    // read gro file
+    double start = monotonic_seconds();
+    system_t *system = read_gro(gro_file, n_threads);
+    if (system == NULL) {
+        if (batch_files != NULL) list_destroy(batch_files);
+        return 1;
+    }
+    timings_add(&timings, PHASE_LOAD_GRO, start, system->n_atoms);
+
+    frame_t *frame = NULL;
+    ndx_writer_t *writer = NULL;
+    atom_selection_t *membrane = NULL;
+    list_t *residue_names = NULL;
+    lipid_topology_t *topology = NULL;
+
+    // try to reuse the lipid topology of the previous run
+    uint64_t fingerprint = 0;
+    if (topology_cache != NULL) {
+        start = monotonic_seconds();
+        fingerprint = topology_fingerprint(system, selected, phosphate, ndx_file);
+        topology = topology_cache_read(topology_cache, fingerprint, system, &residue_names);
+        if (topology != NULL && (membrane = topology_membrane(topology, system)) == NULL) {
+            fprintf(stderr, "Could not allocate memory for membrane selection.\n");
+            return_code = 1;
+            goto main_end;
+        }
+        timings_add(&timings, PHASE_TOPOLOGY_CACHE, start, system->n_atoms);
+    }
+
+    if (topology == NULL) {
+        topology = select_topology(system, ndx_file, ndx_cache, selected, phosphate, &membrane, &residue_names, &timings);
+        if (topology == NULL) {
+            return_code = 1;
+            goto main_end;
+        }
+
+        start = monotonic_seconds();
+        if (topology_cache != NULL && topology_cache_write(topology_cache, fingerprint, system, topology, residue_names) != 0) {
+            fprintf(stderr, "Warning. Could not write topology cache %s.\n", topology_cache);
+        }
+        timings_add(&timings, PHASE_TOPOLOGY_CACHE, start, 0);
+    }
+
+    if (classification.com && topology_masses(topology, system, classification.masses) != 0) {
+        return_code = 1;
+        goto main_end;
+    }
+
+    frame = frame_create(topology, 0);
+    if (frame == NULL) {
+        fprintf(stderr, "Could not allocate memory for leaflet assignment.\n");
+        return_code = 1;
+        goto main_end;
+    }
+
+    // open the output file; if the file exists, append (or replace it)
+    // with --split, the output files are opened for each gro file separately
+    if (!split) writer = ndx_writer_open(output_file, replace);
+    if (!split && writer == NULL) {
+        fprintf(stderr, "The output ndx file could not be opened.\n");
+        return_code = 1;
+        goto main_end;
+    }
+
+    // classify lipids and write out the ndx groups
+    if (batch_files != NULL) {
+        if (process_batch(writer, batch_files, split, replace, topology, &classification, system, membrane, residue_names, n_threads, empty, &timings) != 0) return_code = 1;
+    } else if (traj_file == NULL) {
+        // a single frame can not be processed in parallel with other frames, so the threads are used for its center instead
+        classification.n_threads = n_threads;
+        frame_load(frame, topology, system, 0);
+        if (process_frame(writer, topology, &classification, membrane, residue_names, frame, "", empty) != 0) {
+            fprintf(stderr, "Failed to create ndx groups.\n");
+            return_code = 1;
+        }
+        timings_merge(&timings, &frame->timings);
+    } else if (process_trajectory(writer, traj_file, topology, &classification, system, membrane, residue_names, n_threads, empty, &timings) != 0) {
+        return_code = 1;
+    }
+
+    // output of a failed run never replaces the original output file
+    start = monotonic_seconds();
+    if (return_code != 0) ndx_writer_abort(writer);
+    else if (ndx_writer_destroy(writer) != 0) {
+        fprintf(stderr, "Could not write the ndx groups.\n");
+        return_code = 1;
+    }
+    writer = NULL;
+    timings_add(&timings, PHASE_WRITE, start, 0);
+
+    if (report_timings) timings_print(stderr, &timings, monotonic_seconds() - program_start, report_timings == 2);
+
+    main_end:
+    ndx_writer_abort(writer);
+    topology_destroy(topology);
+    frame_destroy(frame);
+    if (residue_names != NULL) list_destroy(residue_names);
+    free(membrane);
+    free(system);
+    if (batch_files != NULL) list_destroy(batch_files);
+
+    return return_code;
+}
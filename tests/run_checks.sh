@@ -0,0 +1,139 @@
+#!/bin/sh
+# Released under MIT License.
+# Copyright (c) 2023 Ladislav Bartos
+
+# Regression checks of leaflets2ndx on small generated systems.
+# Usage: tests/run_checks.sh
+#
+# Environment variables:
+#   LEAFLETS2NDX   path to the leaflets2ndx binary (default: ./leaflets2ndx)
+
+LEAFLETS2NDX=${LEAFLETS2NDX:-./leaflets2ndx}
+
+CHECK_DIR=$(mktemp -d) || exit 1
+trap 'rm -rf "${CHECK_DIR}"' EXIT
+
+FAILED=0
+
+fail() {
+    echo "FAILED: $*"
+    FAILED=1
+}
+
+# Writes PREFIX.gro and PREFIX.ndx from lines 'RESNAME RESID NAME X Y Z' read from standard input.
+# The ndx file contains the groups Membrane (all atoms) and Heads (atoms named PO4 or ROH).
+# Usage: write_system PREFIX BOX
+write_system() {
+    awk -v box="$2" -v gro="$1.gro" -v ndx="$1.ndx" '
+        {
+            ++n
+            line[n] = sprintf("%5d%-5s%5s%5d%8.3f%8.3f%8.3f", $2, $1, $3, n, $4, $5, $6)
+            if ($3 == "PO4" || $3 == "ROH") heads[++n_heads] = n
+        }
+        END {
+            printf "Generated system\n%5d\n", n > gro
+            for (i = 1; i <= n; ++i) print line[i] > gro
+            printf "%10.5f%10.5f%10.5f\n", box, box, box > gro
+            printf "[ Membrane ]\n" > ndx
+            for (i = 1; i <= n; ++i) printf "%d%s", i, (i % 15 == 0 || i == n) ? "\n" : " " > ndx
+            printf "[ Heads ]\n" > ndx
+            for (i = 1; i <= n_heads; ++i) printf "%d%s", heads[i], (i % 15 == 0 || i == n_heads) ? "\n" : " " > ndx
+        }'
+}
+
+# Writes PREFIX.gro and PREFIX.ndx with layers of 16 POPC lipids (a single PO4 bead each)
+# at the given positions along z in a cubic box of size BOX.
+# Usage: write_layers PREFIX BOX Z...
+write_layers() {
+    PREFIX=$1
+    BOX=$2
+    shift 2
+    echo "$@" | awk -v box="${BOX}" '{
+        for (l = 1; l <= NF; ++l) {
+            for (x = 0; x < 4; ++x) {
+                for (y = 0; y < 4; ++y) print "POPC", ++n, "PO4", x * box / 4, y * box / 4, $l
+            }
+        }
+    }' | write_system "${PREFIX}" "${BOX}"
+}
+
+# Prints lines for write_system describing a layer of 16 lipids with all beads at height Z.
+# Usage: lipid_layer RESNAME FIRST_RESID Z BEAD...
+lipid_layer() {
+    RESNAME=$1
+    FIRST=$2
+    Z=$3
+    shift 3
+    echo "$@" | awk -v resname="${RESNAME}" -v first="${FIRST}" -v z="${Z}" '{
+        for (r = 0; r < 16; ++r) {
+            for (b = 1; b <= NF; ++b) print resname, first + r, $b, (r % 4) * 2.5, int(r / 4) * 2.5, z
+        }
+    }'
+}
+
+# Prints the number of leaflets detected by --stack GAP for PREFIX.gro.
+# Usage: count_stacked PREFIX GAP
+count_stacked() {
+    "${LEAFLETS2NDX}" -c "$1.gro" -n "$1.ndx" --stack "$2" -o - 2> /dev/null | grep -c '^\[ L[0-9]* \]'
+}
+
+# --stack: two layers exactly GAP apart (and slightly more) are separate leaflets wherever they are in the box,
+# including when they are separated by the periodic boundary
+for GAP in 3.0 2.5; do
+    for SEPARATION in "${GAP}" "$(echo "${GAP}" | awk '{ print $1 + 0.05 }')"; do
+        OFFSET=0
+        while [ "${OFFSET}" -lt 200 ]; do
+            Z=$(echo "${OFFSET}" | awk '{ printf "%.3f", $1 * 0.05 }')
+            UPPER=$(echo "${Z} ${SEPARATION}" | awk '{ z = $1 + $2; if (z >= 10.0) z -= 10.0; printf "%.3f", z }')
+            write_layers "${CHECK_DIR}/stack" 10.0 "${Z}" "${UPPER}"
+            LEAFLETS=$(count_stacked "${CHECK_DIR}/stack" "${GAP}")
+            if [ "${LEAFLETS}" != "2" ]; then
+                fail "--stack ${GAP}: layers at z = ${Z} and ${UPPER} nm form ${LEAFLETS} leaflet(s) instead of 2"
+                break
+            fi
+            OFFSET=$((OFFSET + 1))
+        done
+    done
+done
+
+POPC_BEADS="NC3 PO4 GL1 GL2 C1A C2A C1B C2B"
+CHOL_BEADS="ROH R1 R2 R3 R4 R5 C1 C2"
+
+# --com: in a membrane with a cholesterol-rich upper leaflet, the center of mass lies below the center of geometry,
+# so a lipid located between them is assigned into a different leaflet
+{
+    lipid_layer POPC 1 3.0 ${POPC_BEADS}
+    lipid_layer CHOL 17 7.0 ${CHOL_BEADS}
+    echo "POPC 33 NC3 5.0 5.0 4.87" | awk '{ for (b = 2; b <= 8; ++b) print } { print }' | head -n 0
+    for BEAD in ${POPC_BEADS}; do echo "POPC 33 ${BEAD} 5.0 5.0 4.87"; done
+} | write_system "${CHECK_DIR}/asymmetric" 10.0
+for COM in "" "--com"; do
+    # shellcheck disable=SC2086
+    "${LEAFLETS2NDX}" -c "${CHECK_DIR}/asymmetric.gro" -n "${CHECK_DIR}/asymmetric.ndx" -p Heads ${COM} -o - \
+        > "${CHECK_DIR}/asymmetric${COM}.out" 2>&1 || fail "leaflets2ndx ${COM} failed on an asymmetric membrane"
+done
+if ! grep -q '^\[ POPC_lower \]' "${CHECK_DIR}/asymmetric.out" || grep -q '^\[ POPC_upper \]' "${CHECK_DIR}/asymmetric.out"; then
+    fail "without --com, the lipid between the centers is not assigned into the lower leaflet"
+fi
+if ! grep -q '^\[ POPC_upper \]' "${CHECK_DIR}/asymmetric--com.out"; then
+    fail "with --com, the lipid between the centers is not assigned into the upper leaflet"
+fi
+
+# --com: unknown beads of coarse-grained lipids (e.g. sugar beads of glycolipids) are reported, unless their masses are given
+{
+    lipid_layer GLYC 1 3.0 B1 B2 PO4 C1A C2A
+    lipid_layer GLYC 17 7.0 B1 B2 PO4 C1A C2A
+} | write_system "${CHECK_DIR}/glycolipids" 10.0
+if "${LEAFLETS2NDX}" -c "${CHECK_DIR}/glycolipids.gro" -n "${CHECK_DIR}/glycolipids.ndx" -p Heads --com -o - > /dev/null 2>&1; then
+    fail "--com succeeded although masses of beads B1 and B2 are not known"
+fi
+printf "# sugar beads\nGLYC B1 54.0\nB2 36\n" > "${CHECK_DIR}/masses.txt"
+if ! "${LEAFLETS2NDX}" -c "${CHECK_DIR}/glycolipids.gro" -n "${CHECK_DIR}/glycolipids.ndx" -p Heads \
+        --masses "${CHECK_DIR}/masses.txt" -o - > /dev/null 2>&1; then
+    fail "--masses did not provide masses of beads B1 and B2"
+fi
+
+if [ "${FAILED}" -eq 0 ]; then
+    echo "All checks passed."
+fi
+exit "${FAILED}"